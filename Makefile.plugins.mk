@@ -28,6 +28,56 @@ HIPHOP_WASM_RUNTIME ?= wamr
 # WebAssembly execution mode - WAMR [ aot | interp ], Wasmer [ jit ]
 HIPHOP_WASM_MODE ?= aot
 
+# Abort when heap memory is allocated inside WasmPlugin::run(), for debugging
+HIPHOP_WASM_RT_ALLOC_CHECK ?= false
+
+# Persist compiled modules to the user data directory - Wasmer [ jit ] only
+HIPHOP_WASM_MODULE_CACHE ?= true
+
+# AssemblyScript runtime for DSP [ incremental | minimal | stub ]. The stub
+# runtime never frees memory, only use it for plugins not allocating in run().
+# The minimal runtime does not collect on its own, the plugin runs its GC after
+# every block. The incremental runtime collects in steps while allocating.
+HIPHOP_AS_RUNTIME ?= incremental
+
+# Measure time spent in AssemblyScript GC after every block, for debugging.
+# Only meaningful with the minimal runtime, see WasmPlugin::getGcBlockCount()
+HIPHOP_WASM_GC_STATS ?= false
+
+# Initial linear memory of the DSP module in 64 KiB pages, 0 for the compiler
+# default. Large enough memory keeps allocations in run() from growing it, see
+# WasmPlugin::getMemoryGrowBlockCount()
+HIPHOP_WASM_INITIAL_MEMORY ?= 0
+
+# Upper limit for DSP module linear memory in 64 KiB pages, 0 for no limit
+HIPHOP_WASM_MAXIMUM_MEMORY ?= 0
+
+# Output silence for host buffers where DSP run() takes longer than this
+# percentage of their real-time duration, 0 disables the check. The module is
+# muted until the next activation after HIPHOP_WASM_MAX_OVERRUNS consecutive
+# overruns or a trap
+HIPHOP_WASM_CPU_BUDGET ?= 0
+HIPHOP_WASM_MAX_OVERRUNS ?= 8
+
+# Make DSP run() trap after executing this many WebAssembly operators per audio
+# frame, which also stops infinite loops. 0 disables metering - Wasmer [ jit ]
+HIPHOP_WASM_FUEL_PER_FRAME ?= 0
+
+# Threads rendering voices for DSP plugins setting voiceSharding, including the
+# audio thread. Notes are spread over HIPHOP_WASM_VOICE_SHARDS instances of the
+# module running in parallel, 0 shards for one per thread. 0 workers disables
+# sharding. The HIPHOP_WASM_VOICE_WORKERS environment variable overrides the
+# worker count at run time, setting it to 0 disables sharding too. Idle workers
+# poll for the next block during HIPHOP_WASM_VOICE_SPIN_US microseconds before
+# sleeping, 0 sleeps right away.
+HIPHOP_WASM_VOICE_WORKERS ?= 0
+HIPHOP_WASM_VOICE_SHARDS ?= 0
+HIPHOP_WASM_VOICE_SPIN_US ?= 50
+
+# Build an additional DSP binary using WebAssembly SIMD. It is loaded instead of
+# the scalar binary when the runtime supports SIMD - WAMR [ aot ], Wasmer [ jit ]
+HIPHOP_WASM_SIMD ?= false
+
 # Universal build not available for Wasmer DSP
 # Set to false for building current architecture only
 HIPHOP_MACOS_UNIVERSAL ?= false
@@ -147,7 +197,11 @@ endif
 
 ifeq ($(WASM_DSP),true)
 HIPHOP_FILES_DSP += WasmPluginImpl.cpp \
+                    WasmEngine.cpp \
                     WasmRuntime.cpp
+ifeq ($(HIPHOP_WASM_RT_ALLOC_CHECK),true)
+HIPHOP_FILES_DSP += AllocationGuard.cpp
+endif
 endif
 
 FILES_DSP += $(HIPHOP_FILES_DSP:%=$(HIPHOP_SRC_PATH)/dsp/%)
@@ -270,11 +324,50 @@ ifeq ($(WASM_DSP),true)
 BASE_FLAGS += -DHIPHOP_WASM_SUPPORT
 WASM_BYTECODE_FILE = optimized.wasm
 
+ifeq ($(HIPHOP_WASM_RT_ALLOC_CHECK),true)
+BASE_FLAGS += -DHIPHOP_RT_ALLOC_CHECK
+endif
+
+ifeq ($(HIPHOP_AS_RUNTIME),minimal)
+BASE_FLAGS += -DHIPHOP_WASM_COLLECT_PER_BLOCK
+endif
+
+ifeq ($(HIPHOP_WASM_GC_STATS),true)
+BASE_FLAGS += -DHIPHOP_WASM_GC_STATS
+endif
+
+ifeq ($(HIPHOP_WASM_SIMD),true)
+BASE_FLAGS += -DHIPHOP_WASM_SIMD
+WASM_SIMD_BYTECODE_FILE = optimized-simd.wasm
+endif
+
+ifneq ($(HIPHOP_WASM_CPU_BUDGET),0)
+BASE_FLAGS += -DHIPHOP_WASM_CPU_BUDGET=$(HIPHOP_WASM_CPU_BUDGET) \
+              -DHIPHOP_WASM_MAX_OVERRUNS=$(HIPHOP_WASM_MAX_OVERRUNS)
+endif
+
+ifneq ($(HIPHOP_WASM_VOICE_WORKERS),0)
+BASE_FLAGS += -DHIPHOP_WASM_VOICE_WORKERS=$(HIPHOP_WASM_VOICE_WORKERS) \
+              -DHIPHOP_WASM_VOICE_SHARDS=$(HIPHOP_WASM_VOICE_SHARDS) \
+              -DHIPHOP_WASM_VOICE_SPIN_US=$(HIPHOP_WASM_VOICE_SPIN_US)
+endif
+
+ifneq ($(HIPHOP_WASM_FUEL_PER_FRAME),0)
+ifneq ($(HIPHOP_WASM_RUNTIME),wasmer)
+$(error Execution metering is only available for Wasmer)
+endif
+BASE_FLAGS += -DHIPHOP_WASM_FUEL_PER_FRAME=$(HIPHOP_WASM_FUEL_PER_FRAME)
+endif
+
 ifeq ($(HIPHOP_WASM_RUNTIME),wamr)
 BASE_FLAGS += -DHIPHOP_WASM_RUNTIME_WAMR
 ifeq ($(WINDOWS),true)
 endif
 ifeq ($(HIPHOP_WASM_MODE),aot)
+WAMR_AOT = true
+BASE_FLAGS += -DHIPHOP_WASM_BINARY_COMPILED
+endif
+ifeq ($(WAMR_AOT),true)
 ifeq ($(CPU_I386_OR_X86_64),true)
 WAMRC_TARGET = x86_64
 endif
@@ -282,10 +375,13 @@ ifeq ($(CPU_ARM_OR_AARCH64),true)
 WAMRC_TARGET = aarch64
 endif
 WASM_BINARY_FILE = $(WAMRC_TARGET).aot
-BASE_FLAGS += -DHIPHOP_WASM_BINARY_COMPILED
+WASM_SIMD_BINARY_FILE = $(WAMRC_TARGET)-simd.aot
 endif
 ifeq ($(HIPHOP_WASM_MODE),interp)
 WASM_BINARY_FILE = $(WASM_BYTECODE_FILE)
+ifeq ($(HIPHOP_WASM_SIMD),true)
+$(error SIMD is not supported by WAMR interpreter)
+endif
 endif
 ifeq ($(HIPHOP_WASM_MODE),jit)
 $(error JIT mode is not supported for WAMR)
@@ -300,41 +396,48 @@ HIPHOP_WASM_MODE = jit
 endif
 ifeq ($(HIPHOP_WASM_MODE),jit)
 WASM_BINARY_FILE = $(WASM_BYTECODE_FILE)
+WASM_SIMD_BINARY_FILE = $(WASM_SIMD_BYTECODE_FILE)
+ifeq ($(HIPHOP_WASM_MODULE_CACHE),true)
+BASE_FLAGS += -DHIPHOP_WASM_MODULE_CACHE
+endif
 else
 $(error Only JIT mode is supported for Wasmer)
 endif
 endif
 
+# Kept apart from LINK_FLAGS so the benchmark can link without the UI libraries
 ifeq ($(HIPHOP_WASM_RUNTIME),wamr)
 BASE_FLAGS += -I$(WAMR_PATH)/core/iwasm/include
 ifeq ($(LINUX_OR_MACOS),true)
-LINK_FLAGS += -L$(WAMR_BUILD_PATH) -lvmlib
+WASM_LINK_FLAGS += -L$(WAMR_BUILD_PATH) -lvmlib
 endif
 ifeq ($(LINUX),true)
-LINK_FLAGS += -lpthread
+WASM_LINK_FLAGS += -lpthread
 endif
 ifeq ($(WINDOWS),true)
 ifeq ($(HIPHOP_WASM_MODE),interp)
-LINK_FLAGS += -L$(WAMR_BUILD_PATH) -lvmlib
-LINK_FLAGS += -lWs2_32 -lShlwapi
+WASM_LINK_FLAGS += -L$(WAMR_BUILD_PATH) -lvmlib
+WASM_LINK_FLAGS += -lWs2_32 -lShlwapi
 endif
 endif
 endif
 
 ifeq ($(HIPHOP_WASM_RUNTIME),wasmer)
 BASE_FLAGS += -I$(WASMER_PATH)/include
-LINK_FLAGS += -L$(WASMER_PATH)/lib -lwasmer
+WASM_LINK_FLAGS += -L$(WASMER_PATH)/lib -lwasmer
 ifeq ($(LINUX),true)
-LINK_FLAGS += -lpthread -ldl
+WASM_LINK_FLAGS += -lpthread -ldl
 endif
 ifeq ($(MACOS),true)
-LINK_FLAGS += -framework AppKit 
+WASM_LINK_FLAGS += -framework AppKit 
 endif
 ifeq ($(WINDOWS),true)
-LINK_FLAGS += -Wl,-Bstatic -lWs2_32 -lBcrypt -lUserenv -lShlwapi
+WASM_LINK_FLAGS += -Wl,-Bstatic -lWs2_32 -lBcrypt -lUserenv -lShlwapi
 endif
 endif
 
+LINK_FLAGS += $(WASM_LINK_FLAGS)
+
 endif
 
 # ------------------------------------------------------------------------------
@@ -538,6 +641,11 @@ endif
 ifeq ($(HIPHOP_WASM_MODE),interp)
 WAMR_CMAKE_ARGS += -DWAMR_BUILD_AOT=0 -DWAMR_BUILD_INTERP=1
 endif
+ifeq ($(WAMR_AOT),true)
+ifeq ($(HIPHOP_WASM_SIMD),true)
+WAMR_CMAKE_ARGS += -DWAMR_BUILD_SIMD=1
+endif
+endif
 
 ifeq ($(WINDOWS),true)
 # Use the C version of invokeNative() instead of ASM until MinGW build is fixed.
@@ -567,7 +675,7 @@ TARGETS += $(WAMR_DLL_PATH)
 endif
 endif
 
-ifeq ($(HIPHOP_WASM_MODE),aot)
+ifeq ($(WAMR_AOT),true)
 TARGETS += $(WAMRC_BIN_PATH)
 endif
 
@@ -861,18 +969,51 @@ endif
 AS_BUILD_PATH = $(HIPHOP_AS_DSP_PATH)/build
 WASM_BYTECODE_PATH = $(AS_BUILD_PATH)/$(WASM_BYTECODE_FILE)
 WASM_BINARY_PATH = $(AS_BUILD_PATH)/$(WASM_BINARY_FILE)
+WASM_BINARY_PATHS = $(WASM_BINARY_PATH)
 
 HIPHOP_TARGET += $(WASM_BYTECODE_PATH)
 
+AS_ARGS =
+ifneq ($(HIPHOP_AS_RUNTIME),incremental)
+AS_ARGS += --runtime $(HIPHOP_AS_RUNTIME)
+endif
+ifneq ($(HIPHOP_WASM_INITIAL_MEMORY),0)
+AS_ARGS += --initialMemory $(HIPHOP_WASM_INITIAL_MEMORY)
+endif
+ifneq ($(HIPHOP_WASM_MAXIMUM_MEMORY),0)
+AS_ARGS += --maximumMemory $(HIPHOP_WASM_MAXIMUM_MEMORY)
+endif
+
 $(WASM_BYTECODE_PATH): $(AS_ASSEMBLY_PATH)/plugin.ts
 	@echo "Building AssemblyScript project"
 	@# npm --prefix fails on MinGW due to paths mixing \ and /
 	@test -d $(HIPHOP_AS_DSP_PATH)/node_modules \
 		|| (cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) && npm install)
+ifeq ($(strip $(AS_ARGS)),)
 	@cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) && npm run asbuild
+else
+	@cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) \
+		&& npm run asbuild:optimized -- $(AS_ARGS)
+endif
+
+ifeq ($(HIPHOP_WASM_SIMD),true)
+WASM_SIMD_BYTECODE_PATH = $(AS_BUILD_PATH)/$(WASM_SIMD_BYTECODE_FILE)
+WASM_SIMD_BINARY_PATH = $(AS_BUILD_PATH)/$(WASM_SIMD_BINARY_FILE)
+WASM_BINARY_PATHS += $(WASM_SIMD_BINARY_PATH)
+
+AS_SIMD_ARGS = --enable simd --binaryFile build/$(WASM_SIMD_BYTECODE_FILE) \
+               --textFile build/$(WASM_SIMD_BYTECODE_FILE:.wasm=.wat) $(AS_ARGS)
+
+HIPHOP_TARGET += $(WASM_SIMD_BYTECODE_PATH)
+
+$(WASM_SIMD_BYTECODE_PATH): $(WASM_BYTECODE_PATH)
+	@echo "Building AssemblyScript project with SIMD"
+	@cd $(HIPHOP_AS_DSP_PATH) && $(NPM_OPT_SET_PATH) \
+		&& npm run asbuild:optimized -- $(AS_SIMD_ARGS)
+endif
 
 ifeq ($(HIPHOP_WASM_RUNTIME),wamr)
-ifeq ($(HIPHOP_WASM_MODE),aot)
+ifeq ($(WAMR_AOT),true)
 HIPHOP_TARGET += $(WASM_BINARY_PATH)
 
 ifeq ($(CPU_I386_OR_X86_64),true)
@@ -884,10 +1025,53 @@ $(WASM_BINARY_PATH): $(WASM_BYTECODE_PATH)
 	@echo "Compiling WASM AOT module"
 	@$(WAMRC_BIN_PATH) --target=$(WAMRC_TARGET) -o $(WASM_BINARY_PATH) $(WAMRC_ARGS) \
 		$(WASM_BYTECODE_PATH)
+
+ifeq ($(HIPHOP_WASM_SIMD),true)
+HIPHOP_TARGET += $(WASM_SIMD_BINARY_PATH)
+
+# wamrc enables SIMD code generation by default for x86_64 and aarch64
+$(WASM_SIMD_BINARY_PATH): $(WASM_SIMD_BYTECODE_PATH)
+	@echo "Compiling WASM AOT module with SIMD"
+	@$(WAMRC_BIN_PATH) --target=$(WAMRC_TARGET) -o $(WASM_SIMD_BINARY_PATH) $(WAMRC_ARGS) \
+		$(WASM_SIMD_BYTECODE_PATH)
+endif
 endif
 endif
 endif
 
+# ------------------------------------------------------------------------------
+# Headless DSP benchmark, not built by default. Links the plugin DSP objects
+# and runs the plugin like a host would. Run make bench and then for example
+# bin/$(NAME)-bench --blocks 32,64,512 --midi --params 4
+# Pass the path of a DSP binary to also measure snapshot costs.
+
+ifeq ($(WASM_DSP),true)
+BENCH_FILES = WasmBench.cpp
+BENCH_OBJS = $(BENCH_FILES:%.cpp=$(BUILD_DIR)/bench/%.cpp.o)
+BENCH_BIN = $(DPF_TARGET_DIR)/$(NAME)-bench$(APP_EXT)
+
+BENCH_LINK_FLAGS = $(LDFLAGS) $(WASM_LINK_FLAGS)
+ifeq ($(LINUX),true)
+BENCH_LINK_FLAGS += -ldl -lpthread -lrt
+endif
+
+bench: $(WASM_BINARY_PATHS) $(BENCH_BIN)
+	@mkdir -p $(LIB_DIR_NOBUNDLE)/dsp
+	@cp -r $(WASM_BINARY_PATHS) $(LIB_DIR_NOBUNDLE)/dsp
+
+$(BENCH_BIN): $(OBJS_DSP) $(BENCH_OBJS)
+	@echo "Creating DSP benchmark"
+	@mkdir -p $(DPF_TARGET_DIR)
+	@$(CXX) $^ $(BENCH_LINK_FLAGS) -o $@
+
+$(BUILD_DIR)/bench/%.cpp.o: $(HIPHOP_SRC_PATH)/dsp/%.cpp
+	@echo "Compiling $<"
+	@mkdir -p $(BUILD_DIR)/bench
+	@$(CXX) $< $(BUILD_CXX_FLAGS) -c -o $@
+
+.PHONY: bench
+endif
+
 # ------------------------------------------------------------------------------
 # Post build - Always copy AssemblyScript DSP binary
 
@@ -898,19 +1082,19 @@ lib_dsp:
 	@echo "Copying WebAssembly DSP binary"
 	@($(TEST_LV2) \
 		&& mkdir -p $(LIB_DIR_LV2)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_LV2)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATHS) $(LIB_DIR_LV2)/dsp \
 		) || true
 	@($(TEST_VST3) \
 		&& mkdir -p $(LIB_DIR_VST3)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_VST3)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATHS) $(LIB_DIR_VST3)/dsp \
 		) || true
 	@($(TEST_VST2_MACOS) \
 		&& mkdir -p $(LIB_DIR_VST2_MACOS)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_VST2_MACOS)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATHS) $(LIB_DIR_VST2_MACOS)/dsp \
 		) || true
 	@($(TEST_NOBUNDLE) \
 		&& mkdir -p $(LIB_DIR_NOBUNDLE)/dsp \
-		&& cp -r $(WASM_BINARY_PATH) $(LIB_DIR_NOBUNDLE)/dsp/$(WASM_BINARY_FILE) \
+		&& cp -r $(WASM_BINARY_PATHS) $(LIB_DIR_NOBUNDLE)/dsp \
 		) || true
 endif
 
@@ -84,15 +84,19 @@ export default class ASToneExamplePlugin extends DISTRHO.Plugin implements DISTR
         const output_r = outputs[1]
         const radiansPerSample = PI_2 * this.frequency / this.samplerate
 
-        let sample: f32
+        const frames = output_l.length
         let phase: f32 = this.phase
 
-        for (let i = 0; i < output_l.length; ++i) {
-            sample = Mathf.sin(phase)
+        // Compute phases first, then the sine of the whole block at once so it
+        // can use SIMD when available
+        for (let i = 0; i < frames; ++i) {
+            output_l[i] = phase
             phase += radiansPerSample
-            output_l[i] = output_r[i] = sample
         }
 
+        DISTRHO.DSP.sin(output_l, output_l, frames)
+        memory.copy(output_r.dataStart, output_l.dataStart, <usize>frames << 2)
+
         while (phase > PI_2) phase -= PI_2
 
         this.phase = phase
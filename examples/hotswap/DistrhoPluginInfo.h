@@ -19,6 +19,12 @@
  */
 #define HIPHOP_SHARED_MEMORY_SIZE 1048576 // 1 MiB
 
+/**
+   Crossfade length in milliseconds when hot-swapping the DSP binary.@n
+   The old and new instances run side by side during the fade, 0 disables it.
+ */
+#define HIPHOP_HOTSWAP_CROSSFADE_MS 50
+
 /**
    Enable WebAssembly System Interface (WASI).
    @note This feature is only available for the Wasmer runtime.
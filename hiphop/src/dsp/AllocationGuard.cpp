@@ -0,0 +1,206 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "AllocationGuard.hpp"
+
+// Only built when HIPHOP_WASM_RT_ALLOC_CHECK=true. All replaceable forms of the
+// global operator new and delete are replaced, otherwise sized, nothrow or
+// aligned calls would slip past the check. <new> declares them with default
+// visibility, so the replacements can also end up serving other code loaded
+// into the host process. Only enable this for debug builds.
+
+#if defined(HIPHOP_RT_ALLOC_CHECK)
+
+USE_NAMESPACE_DISTRHO
+
+static void checkAllocation(const char* operation)
+{
+    const char* scope = ScopedAllocationGuard::currentScope();
+
+    if (scope != nullptr) {
+        ScopedAllocationGuard::currentScope() = nullptr; // fprintf() may allocate
+        std::fprintf(stderr, "Heap %s inside %s() on the audio thread\n", operation, scope);
+        std::abort();
+    }
+}
+
+static void* allocate(std::size_t size) noexcept
+{
+    checkAllocation("allocation");
+
+    return std::malloc(size > 0 ? size : 1);
+}
+
+static void deallocate(void* ptr) noexcept
+{
+    if (ptr != nullptr) {
+        checkAllocation("deallocation");
+        std::free(ptr);
+    }
+}
+
+void* operator new(std::size_t size)
+{
+    void* ptr = allocate(size);
+
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size);
+}
+
+void operator delete(void* ptr) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    deallocate(ptr);
+}
+
+#if defined(__cpp_sized_deallocation)
+void operator delete(void* ptr, std::size_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept
+{
+    deallocate(ptr);
+}
+#endif
+
+#if defined(__cpp_aligned_new)
+// Only used for alignments above the default, which are always valid for
+// posix_memalign(). Windows memory from _aligned_malloc() needs _aligned_free().
+
+static void* allocateAligned(std::size_t size, std::align_val_t alignment) noexcept
+{
+    checkAllocation("allocation");
+
+    const std::size_t align = static_cast<std::size_t>(alignment);
+    size = size > 0 ? size : 1;
+# if defined(DISTRHO_OS_WINDOWS)
+    return _aligned_malloc(size, align);
+# else
+    void* ptr = nullptr;
+    return posix_memalign(&ptr, align, size) == 0 ? ptr : nullptr;
+# endif
+}
+
+static void deallocateAligned(void* ptr) noexcept
+{
+    if (ptr != nullptr) {
+        checkAllocation("deallocation");
+# if defined(DISTRHO_OS_WINDOWS)
+        _aligned_free(ptr);
+# else
+        std::free(ptr);
+# endif
+    }
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    void* ptr = allocateAligned(size, alignment);
+
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+
+    return ptr;
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return operator new(size, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocateAligned(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    return allocateAligned(size, alignment);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    deallocateAligned(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    deallocateAligned(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    deallocateAligned(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept
+{
+    deallocateAligned(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    deallocateAligned(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    deallocateAligned(ptr);
+}
+#endif // __cpp_aligned_new
+
+#endif // HIPHOP_RT_ALLOC_CHECK
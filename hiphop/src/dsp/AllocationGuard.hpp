@@ -0,0 +1,67 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALLOCATION_GUARD_HPP
+#define ALLOCATION_GUARD_HPP
+
+#include "src/DistrhoDefines.h"
+
+START_NAMESPACE_DISTRHO
+
+// Debug helper for real-time code. When built with HIPHOP_RT_ALLOC_CHECK the
+// global operator new and delete are replaced (see AllocationGuard.cpp) and
+// any heap operation performed by a thread while a guard is alive aborts the
+// process. Otherwise the guard compiles to nothing. Error paths that allocate
+// while building an exception, like a trap, suspend the guard for their scope.
+
+#if defined(HIPHOP_RT_ALLOC_CHECK)
+class ScopedAllocationGuard
+{
+public:
+    ScopedAllocationGuard(const char* scope) noexcept
+        : fPreviousScope(currentScope())
+    {
+        currentScope() = scope;
+    }
+
+    ~ScopedAllocationGuard() noexcept
+    {
+        currentScope() = fPreviousScope;
+    }
+
+    static const char*& currentScope() noexcept
+    {
+        static thread_local const char* scope = nullptr;
+        return scope;
+    }
+
+private:
+    const char* fPreviousScope;
+
+};
+
+# define SCOPED_ALLOCATION_GUARD() ScopedAllocationGuard allocationGuard(__FUNCTION__)
+# define SUSPEND_ALLOCATION_GUARD() ScopedAllocationGuard allocationGuardSuspend(nullptr)
+#else
+# define SCOPED_ALLOCATION_GUARD()
+# define SUSPEND_ALLOCATION_GUARD()
+#endif // HIPHOP_RT_ALLOC_CHECK
+
+END_NAMESPACE_DISTRHO
+
+#endif  // ALLOCATION_GUARD_HPP
@@ -0,0 +1,136 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+
+#include "src/DistrhoDefines.h"
+#include "distrho/extra/LeakDetector.hpp"
+
+#if defined(DISTRHO_OS_WINDOWS)
+# include <windows.h>
+#else
+# include <fcntl.h>
+# include <unistd.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+#endif
+
+START_NAMESPACE_DISTRHO
+
+// Read-only view of a whole file backed by the OS page cache. Pages are loaded
+// on demand and are shared between processes mapping the same file.
+
+class MappedFile
+{
+public:
+    explicit MappedFile(const char* path) noexcept
+        : fData(nullptr)
+        , fSize(0)
+#if defined(DISTRHO_OS_WINDOWS)
+        , fMapping(nullptr)
+#endif
+    {
+#if defined(DISTRHO_OS_WINDOWS)
+        HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                  FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return;
+        }
+
+        LARGE_INTEGER size;
+
+        if (GetFileSizeEx(file, &size) && (size.QuadPart > 0)) {
+            fMapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+            if (fMapping != nullptr) {
+                fData = static_cast<const unsigned char*>(MapViewOfFile(fMapping, FILE_MAP_READ, 0, 0, 0));
+                fSize = fData != nullptr ? static_cast<size_t>(size.QuadPart) : 0;
+            }
+        }
+
+        CloseHandle(file); // the mapping keeps its own reference
+#else
+        const int fd = open(path, O_RDONLY);
+        if (fd == -1) {
+            return;
+        }
+
+        struct stat st;
+
+        if ((fstat(fd, &st) == 0) && (st.st_size > 0)) {
+            void* addr = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (addr != MAP_FAILED) {
+                fData = static_cast<const unsigned char*>(addr);
+                fSize = static_cast<size_t>(st.st_size);
+            }
+        }
+
+        close(fd); // the mapping keeps its own reference
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if defined(DISTRHO_OS_WINDOWS)
+        if (fData != nullptr) {
+            UnmapViewOfFile(fData);
+        }
+
+        if (fMapping != nullptr) {
+            CloseHandle(fMapping);
+        }
+#else
+        if (fData != nullptr) {
+            munmap(const_cast<unsigned char*>(fData), fSize);
+        }
+#endif
+    }
+
+    bool isValid() const noexcept
+    {
+        return fData != nullptr;
+    }
+
+    const unsigned char* getData() const noexcept
+    {
+        return fData;
+    }
+
+    size_t getSize() const noexcept
+    {
+        return fSize;
+    }
+
+private:
+    const unsigned char* fData;
+    size_t               fSize;
+#if defined(DISTRHO_OS_WINDOWS)
+    HANDLE               fMapping;
+#endif
+
+    DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(MappedFile)
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // MAPPED_FILE_HPP
@@ -0,0 +1,103 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SEMAPHORE_HPP
+#define SEMAPHORE_HPP
+
+#include "src/DistrhoDefines.h"
+
+#if DISTRHO_OS_MAC
+# include <dispatch/dispatch.h>
+#elif DISTRHO_OS_WINDOWS
+# include <climits>
+# include <windows.h>
+#else
+# include <cerrno>
+# include <semaphore.h>
+#endif
+
+START_NAMESPACE_DISTRHO
+
+// Counting semaphore for waking threads from the audio thread. Unlike DPF
+// Signal, post() takes no mutex, it is an atomic increment that only enters
+// the kernel when a thread is actually waiting. Posts are never lost, a post
+// made before the waiter gets to wait() returns immediately.
+
+class Semaphore
+{
+public:
+    Semaphore() noexcept
+    {
+#if DISTRHO_OS_MAC
+        fSemaphore = dispatch_semaphore_create(0);
+#elif DISTRHO_OS_WINDOWS
+        fSemaphore = ::CreateSemaphoreA(nullptr, 0, LONG_MAX, nullptr);
+#else
+        ::sem_init(&fSemaphore, 0, 0);
+#endif
+    }
+
+    ~Semaphore() noexcept
+    {
+#if DISTRHO_OS_MAC
+        dispatch_release(fSemaphore);
+#elif DISTRHO_OS_WINDOWS
+        ::CloseHandle(fSemaphore);
+#else
+        ::sem_destroy(&fSemaphore);
+#endif
+    }
+
+    void post() noexcept
+    {
+#if DISTRHO_OS_MAC
+        dispatch_semaphore_signal(fSemaphore);
+#elif DISTRHO_OS_WINDOWS
+        ::ReleaseSemaphore(fSemaphore, 1, nullptr);
+#else
+        ::sem_post(&fSemaphore);
+#endif
+    }
+
+    void wait() noexcept
+    {
+#if DISTRHO_OS_MAC
+        dispatch_semaphore_wait(fSemaphore, DISPATCH_TIME_FOREVER);
+#elif DISTRHO_OS_WINDOWS
+        ::WaitForSingleObject(fSemaphore, INFINITE);
+#else
+        while ((::sem_wait(&fSemaphore) != 0) && (errno == EINTR));
+#endif
+    }
+
+private:
+#if DISTRHO_OS_MAC
+    dispatch_semaphore_t fSemaphore;
+#elif DISTRHO_OS_WINDOWS
+    HANDLE               fSemaphore;
+#else
+    sem_t                fSemaphore;
+#endif
+
+    DISTRHO_DECLARE_NON_COPYABLE(Semaphore)
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // SEMAPHORE_HPP
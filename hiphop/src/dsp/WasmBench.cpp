@@ -0,0 +1,557 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Headless benchmark for AssemblyScript DSP plugins. Links the plugin DSP code
+// and creates the plugin through createPlugin() like a host would, then calls
+// activate() and run() so the measured path is WasmPlugin::runBuffer() and
+// everything below it. The DSP binary is loaded from the plugin library
+// directory next to the executable, bin/<name>-lib/dsp like the standalone.
+// Results are printed to stdout as one JSON object per configuration.
+// With --workers and a plugin built with HIPHOP_WASM_VOICE_WORKERS each
+// configuration also runs with the given voice worker counts, for measuring
+// the scaling of voice sharding. A count of 0 runs without voice sharding. When a DSP binary path is given the module is
+// first loaded into a bare WasmRuntime for measuring load time, peak memory
+// growth during load and snapshot costs, checking that rolling back to a
+// snapshot reproduces the same block, and comparing export lookups by name
+// against resolved handles.
+//
+// Usage: <name>-bench [--rates 44100,48000] [--blocks 32,64,512] [--seconds 10]
+//                     [--workers 0,1,2,4,8] [--midi] [--params 4] [dsp/binary]
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Plugin internals are normally compiled into each plugin format wrapper, the
+// benchmark is a standalone executable with no format
+#define DISTRHO_IS_STANDALONE 1
+#include "src/DistrhoPlugin.cpp"
+#include "src/DistrhoUtils.cpp"
+
+#include "WasmPlugin.hpp"
+
+#if DISTRHO_OS_WINDOWS
+# include <windows.h>
+# include <psapi.h>
+#else
+# include <sys/resource.h>
+#endif
+
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+# define RUNTIME_NAME "wamr"
+# if defined(HIPHOP_WASM_BINARY_COMPILED)
+#  define MODE_NAME "aot"
+# else
+#  define MODE_NAME "interp"
+# endif
+#elif defined(HIPHOP_WASM_RUNTIME_WASMER)
+# define RUNTIME_NAME "wasmer"
+# define MODE_NAME "jit"
+#endif
+
+#if DISTRHO_PLUGIN_NUM_INPUTS > DISTRHO_PLUGIN_NUM_OUTPUTS
+# define MAX_AUDIO_CHANNELS DISTRHO_PLUGIN_NUM_INPUTS
+#elif DISTRHO_PLUGIN_NUM_OUTPUTS > 0
+# define MAX_AUDIO_CHANNELS DISTRHO_PLUGIN_NUM_OUTPUTS
+#else
+# define MAX_AUDIO_CHANNELS 1
+#endif
+
+// Same as the MIDI block requested by the plugin
+#define MIDI_BLOCK_BYTES HIPHOP_WASM_MIDI_BUFFER_SIZE
+
+// Leaves the worker count chosen at build time, 0 disables voice sharding
+#define BUILD_WORKER_COUNT UINT32_MAX
+
+USE_NAMESPACE_DISTRHO
+
+typedef std::chrono::steady_clock Clock;
+
+// Host functions imported by the module, for the bare runtime
+struct BenchHost
+{
+    float sampleRate;
+
+    float getSampleRate() const { return sampleRate; }
+};
+
+struct BenchConfig
+{
+    std::vector<uint32_t> sampleRates;
+    std::vector<uint32_t> blockSizes;
+    std::vector<uint32_t> workerCounts;
+    double                seconds;
+    bool                  midi;
+    uint32_t              parameterCount;
+    const char*           binaryPath;
+};
+
+struct BenchResult
+{
+    double                instantiateMs;
+    uint32_t              blockCount;
+    double                nsPerSample;
+    std::vector<uint64_t> blockNs;
+    uint32_t              trapCount;
+    uint32_t              overrunCount;
+    uint32_t              memoryGrowBlockCount;
+    uint32_t              voiceWorkerCount;
+    uint32_t              voiceShardCount;
+#if defined(HIPHOP_WASM_GC_STATS)
+    double                gcNsPerBlock;
+#endif
+};
+
+static uint64_t elapsedNs(const Clock::time_point& t0)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - t0).count();
+}
+
+static std::vector<uint32_t> parseList(const char* s, bool allowZero = false)
+{
+    std::vector<uint32_t> list;
+
+    while (*s != '\0') {
+        char* end;
+        const unsigned long value = std::strtoul(s, &end, 10);
+
+        if ((end == s) || ((value == 0) && ! allowZero)) {
+            break;
+        }
+
+        list.push_back(static_cast<uint32_t>(value));
+        s = (*end == ',') ? end + 1 : end;
+    }
+
+    return list;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+
+    const size_t index = static_cast<size_t>(p * (sorted.size() - 1) + 0.5);
+
+    return sorted[std::min(index, sorted.size() - 1)];
+}
+
+// Alternates note on and note off every 100 ms, timed within the block
+static uint32_t makeMidiEvent(MidiEvent& event, uint64_t frame, uint32_t frames, uint32_t sampleRate)
+{
+    const uint64_t period = sampleRate / 10;
+    const uint64_t next = ((frame + period - 1) / period) * period;
+
+    if (next >= frame + frames) {
+        return 0;
+    }
+
+    const bool noteOn = ((next / period) % 2) == 0;
+
+    event.frame = static_cast<uint32_t>(next - frame);
+    event.size = 3;
+    event.data[0] = noteOn ? 0x90 : 0x80;
+    event.data[1] = 60;
+    event.data[2] = noteOn ? 100 : 0;
+    event.dataExt = nullptr;
+
+    return 1;
+}
+
+static void setVoiceWorkerCount(uint32_t workers)
+{
+    // Read by the plugin when it creates voice shards
+    const bool buildDefault = workers == BUILD_WORKER_COUNT;
+    char value[16];
+    std::snprintf(value, sizeof(value), "%u", workers);
+#if DISTRHO_OS_WINDOWS
+    ::_putenv_s("HIPHOP_WASM_VOICE_WORKERS", buildDefault ? "" : value);
+#else
+    if (buildDefault) {
+        ::unsetenv("HIPHOP_WASM_VOICE_WORKERS");
+    } else {
+        ::setenv("HIPHOP_WASM_VOICE_WORKERS", value, 1);
+    }
+#endif
+}
+
+static BenchResult runBench(const BenchConfig& config, uint32_t sampleRate, uint32_t blockSize,
+                            uint32_t workers)
+{
+    BenchResult result;
+
+    setVoiceWorkerCount(workers);
+
+    // Read by the Plugin constructor, same as plugin format wrappers do
+    d_nextSampleRate = sampleRate;
+    d_nextBufferSize = blockSize;
+
+    const Clock::time_point t0 = Clock::now();
+    std::unique_ptr<Plugin> instance(createPlugin());
+    WasmPlugin* plugin = dynamic_cast<WasmPlugin*>(instance.get());
+
+    if (plugin == nullptr) {
+        throw std::runtime_error("createPlugin() did not return a WasmPlugin");
+    }
+
+    plugin->activate();
+    result.instantiateMs = elapsedNs(t0) / 1e6;
+
+    // Synthetic input, white noise from a fixed seed LCG
+    std::vector<float> input(static_cast<size_t>(blockSize) * MAX_AUDIO_CHANNELS);
+    std::vector<float> output(input.size());
+    const float* inputs[MAX_AUDIO_CHANNELS];
+    float* outputs[MAX_AUDIO_CHANNELS];
+    uint32_t seed = 1;
+
+    for (size_t i = 0; i < input.size(); i++) {
+        seed = seed * 1664525 + 1013904223;
+        input[i] = static_cast<float>(seed >> 8) / 8388608.f - 1.f;
+    }
+
+    for (int i = 0; i < MAX_AUDIO_CHANNELS; i++) {
+        inputs[i] = input.data() + i * blockSize;
+        outputs[i] = output.data() + i * blockSize;
+    }
+
+    const uint32_t blockCount = std::max<uint32_t>(1,
+        static_cast<uint32_t>(config.seconds * sampleRate / blockSize));
+    const uint32_t warmupCount = std::min<uint32_t>(blockCount, 100);
+    uint64_t frame = 0;
+
+    result.blockCount = blockCount;
+    result.blockNs.reserve(blockCount);
+
+#if defined(HIPHOP_WASM_GC_STATS)
+    uint64_t gcTimeNs = 0;
+#endif
+
+    for (uint32_t i = 0; i < warmupCount + blockCount; i++) {
+#if defined(HIPHOP_WASM_GC_STATS)
+        if (i == warmupCount) {
+            gcTimeNs = plugin->getGcTimeNs();
+        }
+#endif
+
+        const Clock::time_point blockStart = Clock::now();
+
+        // Parameter changes as a host automating them would send, applied by
+        // the plugin at the start of the next block
+        for (uint32_t j = 0; j < config.parameterCount; j++) {
+            plugin->setParameterValue(j, static_cast<float>((i + j) % 100) / 100.f);
+        }
+
+#if DISTRHO_PLUGIN_WANT_MIDI_INPUT
+        MidiEvent midiEvent;
+        const uint32_t midiEventCount = config.midi
+            ? makeMidiEvent(midiEvent, frame, blockSize, sampleRate) : 0;
+        plugin->run(inputs, outputs, blockSize, &midiEvent, midiEventCount);
+#else
+        plugin->run(inputs, outputs, blockSize);
+#endif
+
+        const uint64_t blockNs = elapsedNs(blockStart);
+        frame += blockSize;
+
+        if (i >= warmupCount) {
+            result.blockNs.push_back(blockNs);
+        }
+    }
+
+    plugin->deactivate();
+
+    result.trapCount = plugin->getTrapCount();
+    result.overrunCount = plugin->getOverrunCount();
+    result.memoryGrowBlockCount = plugin->getMemoryGrowBlockCount();
+#if HIPHOP_WASM_VOICE_WORKERS
+    result.voiceWorkerCount = plugin->getVoiceWorkerCount();
+    result.voiceShardCount = plugin->getVoiceShardCount();
+#else
+    result.voiceWorkerCount = 0;
+    result.voiceShardCount = 0;
+#endif
+#if defined(HIPHOP_WASM_GC_STATS)
+    result.gcNsPerBlock = static_cast<double>(plugin->getGcTimeNs() - gcTimeNs) / blockCount;
+#endif
+
+    uint64_t totalNs = 0;
+
+    for (size_t i = 0; i < result.blockNs.size(); i++) {
+        totalNs += result.blockNs[i];
+    }
+
+    result.nsPerSample = static_cast<double>(totalNs) / (static_cast<double>(blockCount) * blockSize);
+    std::sort(result.blockNs.begin(), result.blockNs.end());
+
+    return result;
+}
+
+static void printResult(const BenchConfig& config, uint32_t sampleRate, uint32_t blockSize,
+                        const BenchResult& result)
+{
+    const double budgetNs = 1e9 * blockSize / sampleRate;
+    const uint64_t p99 = percentile(result.blockNs, 0.99);
+
+    char extraStats[128] = "";
+#if defined(HIPHOP_WASM_GC_STATS)
+    std::snprintf(extraStats, sizeof(extraStats), ",\"gc_ns_per_block\":%.1f", result.gcNsPerBlock);
+#endif
+
+    std::printf("{\"runtime\":\"" RUNTIME_NAME "\",\"mode\":\"" MODE_NAME "\","
+                "\"sample_rate\":%u,\"block_size\":%u,\"workers\":%u,\"voice_shards\":%u,"
+                "\"blocks\":%u,\"midi\":%s,\"params\":%u,"
+                "\"instantiate_ms\":%.3f,\"ns_per_sample\":%.3f,"
+                "\"block_ns\":{\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu},"
+                "\"traps\":%u,\"overruns\":%u,\"memory_grow_blocks\":%u,"
+                "\"p99_budget_ratio\":%.4f%s}\n",
+                sampleRate, blockSize, result.voiceWorkerCount, result.voiceShardCount,
+                result.blockCount, config.midi ? "true" : "false",
+                config.parameterCount, result.instantiateMs, result.nsPerSample,
+                static_cast<unsigned long long>(percentile(result.blockNs, 0)),
+                static_cast<unsigned long long>(percentile(result.blockNs, 0.5)),
+                static_cast<unsigned long long>(percentile(result.blockNs, 0.9)),
+                static_cast<unsigned long long>(p99),
+                static_cast<unsigned long long>(percentile(result.blockNs, 1)),
+                result.trapCount, result.overrunCount, result.memoryGrowBlockCount,
+                p99 / budgetNs, extraStats);
+    std::fflush(stdout);
+}
+
+// Process peak resident set size in KiB, it never decreases
+static uint64_t getPeakRssKb()
+{
+#if DISTRHO_OS_WINDOWS
+    PROCESS_MEMORY_COUNTERS counters;
+    if (! ::K32GetProcessMemoryInfo(::GetCurrentProcess(), &counters, sizeof(counters))) {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    if (::getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+# if DISTRHO_OS_MAC
+    return usage.ru_maxrss / 1024; // bytes
+# else
+    return usage.ru_maxrss;
+# endif
+#endif
+}
+
+// Runs one block of a fixed input and copies the output
+static void runRuntimeBlock(WasmRuntime& runtime, WasmFunctionHandle run, uint32_t frames,
+                            std::vector<byte_t>& output)
+{
+    float32_t* input = reinterpret_cast<float32_t *>(runtime.getMemory(
+        runtime.getGlobal("_rw_input_block")));
+
+    for (uint32_t i = 0; i < frames * DISTRHO_PLUGIN_NUM_INPUTS; i++) {
+        input[i] = static_cast<float32_t>(i % 64) / 32.f - 1.f;
+    }
+
+    runtime.call(run, frames, 0u, 0u);
+
+    const byte_t* audio = runtime.getMemory(runtime.getGlobal("_rw_output_block"));
+    output.assign(audio, audio + frames * DISTRHO_PLUGIN_NUM_OUTPUTS * 4);
+}
+
+static void runRuntimeBench(const BenchConfig& config)
+{
+    // Costs below the plugin API, measured on a bare instance of the module
+
+    BenchHost host = { static_cast<float>(config.sampleRates[0]) };
+    WasmHostFunctionMap hostFunc;
+    hostFunc["get_samplerate"] = MakeHostFunction(&host, &BenchHost::getSampleRate);
+
+    // Runs before any plugin instance so the peak reflects loading alone
+    const uint64_t rssBeforeKb = getPeakRssKb();
+    Clock::time_point t0 = Clock::now();
+    WasmRuntime runtime;
+    runtime.load(config.binaryPath);
+    const double loadMs = elapsedNs(t0) / 1e6;
+    const uint64_t loadPeakRssKb = getPeakRssKb() - rssBeforeKb;
+    runtime.createInstance(hostFunc);
+    runtime.setGlobal("_rw_num_inputs", MakeI32(DISTRHO_PLUGIN_NUM_INPUTS));
+    runtime.setGlobal("_rw_num_outputs", MakeI32(DISTRHO_PLUGIN_NUM_OUTPUTS));
+    runtime.setGlobal("_rw_block_frames", MakeI32(config.blockSizes[0]));
+    runtime.setGlobal("_rw_midi_block_bytes", MakeI32(MIDI_BLOCK_BYTES));
+    runtime.callFunction("init");
+    runtime.callFunction("activate");
+
+    const WasmFunctionHandle run = runtime.getFunctionHandle("run");
+    const uint32_t frames = config.blockSizes[0];
+    std::vector<byte_t> output, rolledBackOutput;
+
+    for (int i = 0; i < 8; i++) {
+        runRuntimeBlock(runtime, run, frames, output);
+    }
+
+    // Round trip: run a block, roll back and run it again. Same output and
+    // memory mean the module state is fully covered by the snapshot.
+    t0 = Clock::now();
+    const std::shared_ptr<const WasmSnapshot> snapshot = runtime.takeSnapshot();
+    const double snapshotUs = elapsedNs(t0) / 1e3;
+
+    runRuntimeBlock(runtime, run, frames, output);
+    const std::shared_ptr<const WasmSnapshot> afterBlock = runtime.takeSnapshot();
+
+    t0 = Clock::now();
+    runtime.restoreSnapshot(*snapshot);
+    const double restoreUs = elapsedNs(t0) / 1e3;
+
+    const bool restored = std::memcmp(runtime.getMemory(), snapshot->memory.data(),
+                                      snapshot->memory.size()) == 0;
+
+    runRuntimeBlock(runtime, run, frames, rolledBackOutput);
+    const std::shared_ptr<const WasmSnapshot> afterRollback = runtime.takeSnapshot();
+
+    const bool outputMatch = output == rolledBackOutput;
+    const bool memoryMatch = afterBlock->memory == afterRollback->memory;
+
+    // Calls and global reads through export names, as the plugin did before
+    // resolving handles once per instance, against the same through handles
+    const WasmFunctionHandle getVersion = runtime.getFunctionHandle("get_version");
+    const WasmGlobalHandle outputBlock = runtime.getGlobalHandle("_rw_output_block");
+    const int lookupCount = 100000;
+    volatile int32_t sink = 0;
+
+    t0 = Clock::now();
+    for (int i = 0; i < lookupCount; i++) {
+        sink += runtime.callFunctionReturnSingleValue("get_version").of.i32;
+    }
+    const double callByNameNs = static_cast<double>(elapsedNs(t0)) / lookupCount;
+
+    t0 = Clock::now();
+    for (int i = 0; i < lookupCount; i++) {
+        sink += runtime.call<int32_t>(getVersion);
+    }
+    const double callByHandleNs = static_cast<double>(elapsedNs(t0)) / lookupCount;
+
+    t0 = Clock::now();
+    for (int i = 0; i < lookupCount; i++) {
+        sink += runtime.getGlobal("_rw_output_block").of.i32;
+    }
+    const double globalByNameNs = static_cast<double>(elapsedNs(t0)) / lookupCount;
+
+    t0 = Clock::now();
+    for (int i = 0; i < lookupCount; i++) {
+        sink += runtime.getGlobal(outputBlock).of.i32;
+    }
+    const double globalByHandleNs = static_cast<double>(elapsedNs(t0)) / lookupCount;
+
+    runtime.callFunction("deactivate");
+
+    char cacheStats[96] = "";
+#if defined(HIPHOP_WASM_MODULE_CACHE)
+    // Disk cache counts accumulate over the whole process
+    const std::shared_ptr<WasmEngine> engine = WasmEngine::getInstance();
+    std::snprintf(cacheStats, sizeof(cacheStats), ",\"disk_cache\":{\"hits\":%u,\"misses\":%u}",
+                  engine->getDiskCacheHits(), engine->getDiskCacheMisses());
+#endif
+
+    std::printf("{\"runtime\":\"" RUNTIME_NAME "\",\"mode\":\"%s\",\"binary\":\"%s\","
+                "\"load_ms\":%.3f,\"load_peak_rss_kb\":%llu,\"memory_pages\":%u,\"snapshot_us\":%.1f,\"restore_us\":%.1f,"
+                "\"round_trip\":{\"restored\":%s,\"output_match\":%s,\"memory_match\":%s},"
+                "\"call_ns\":{\"by_name\":%.1f,\"by_handle\":%.1f},"
+                "\"global_ns\":{\"by_name\":%.1f,\"by_handle\":%.1f}%s}\n",
+                runtime.getModeName(), config.binaryPath, loadMs,
+                static_cast<unsigned long long>(loadPeakRssKb), runtime.getMemoryPages(),
+                snapshotUs, restoreUs, restored ? "true" : "false",
+                outputMatch ? "true" : "false", memoryMatch ? "true" : "false",
+                callByNameNs, callByHandleNs, globalByNameNs, globalByHandleNs, cacheStats);
+    std::fflush(stdout);
+}
+
+static void printUsage(const char* argv0)
+{
+    std::fprintf(stderr, "Usage: %s [--rates 44100,48000] [--blocks 32,64,512] [--seconds 10] "
+                         "[--workers 0,1,2,4,8] [--midi] [--params 4] [dsp/binary]\n", argv0);
+}
+
+int main(int argc, char* argv[])
+{
+    BenchConfig config;
+    config.sampleRates = { 48000 };
+    config.blockSizes = { 32, 64, 128, 256, 512 };
+    config.workerCounts = { BUILD_WORKER_COUNT };
+    config.seconds = 10;
+    config.midi = false;
+    config.parameterCount = 0;
+    config.binaryPath = nullptr;
+
+    for (int i = 1; i < argc; i++) {
+        const bool hasValue = i + 1 < argc;
+
+        if ((std::strcmp(argv[i], "--rates") == 0) && hasValue) {
+            config.sampleRates = parseList(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--blocks") == 0) && hasValue) {
+            config.blockSizes = parseList(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--workers") == 0) && hasValue) {
+            config.workerCounts = parseList(argv[++i], true);
+        } else if ((std::strcmp(argv[i], "--seconds") == 0) && hasValue) {
+            config.seconds = std::atof(argv[++i]);
+        } else if ((std::strcmp(argv[i], "--params") == 0) && hasValue) {
+            config.parameterCount = static_cast<uint32_t>(std::strtoul(argv[++i], nullptr, 10));
+        } else if (std::strcmp(argv[i], "--midi") == 0) {
+            config.midi = true;
+        } else if (argv[i][0] != '-') {
+            config.binaryPath = argv[i];
+        } else {
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.sampleRates.empty() || config.blockSizes.empty() || config.workerCounts.empty()
+            || (config.seconds <= 0)) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    try {
+        if (config.binaryPath != nullptr) {
+            runRuntimeBench(config);
+        }
+
+        for (size_t i = 0; i < config.sampleRates.size(); i++) {
+            for (size_t j = 0; j < config.blockSizes.size(); j++) {
+                for (size_t k = 0; k < config.workerCounts.size(); k++) {
+                    const uint32_t sampleRate = config.sampleRates[i];
+                    const uint32_t blockSize = config.blockSizes[j];
+
+                    printResult(config, sampleRate, blockSize,
+                                runBench(config, sampleRate, blockSize, config.workerCounts[k]));
+                }
+            }
+        }
+    } catch (const std::exception& ex) {
+        std::fprintf(stderr, "%s\n", ex.what());
+        return 1;
+    }
+
+    return 0;
+}
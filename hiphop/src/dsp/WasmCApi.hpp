@@ -204,6 +204,16 @@ public:
 #endif
     }
 
+    inline bool wasm_module_validate(wasm_store_t* arg0, const wasm_byte_vec_t* arg1)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef bool (*FuncType)(wasm_store_t*, const wasm_byte_vec_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0, arg1);
+#else
+        return ::wasm_module_validate(arg0, arg1);
+#endif
+    }
+
     inline void wasm_module_delete(own wasm_module_t* arg0)
     {
 #if defined(HIPHOP_WASM_DLL)
@@ -234,6 +244,28 @@ public:
 #endif
     }
 
+#if defined(HIPHOP_WASM_RUNTIME_WASMER)
+    inline void wasm_module_serialize(const wasm_module_t* arg0, own wasm_byte_vec_t* arg1)
+    {
+# if defined(HIPHOP_WASM_DLL)
+        typedef void (*FuncType)(const wasm_module_t*, own wasm_byte_vec_t*);
+        DLL_SYMBOL(__FUNCTION__,FuncType)(arg0, arg1);
+# else
+        ::wasm_module_serialize(arg0, arg1);
+# endif
+    }
+
+    inline own wasm_module_t* wasm_module_deserialize(wasm_store_t* arg0, const wasm_byte_vec_t* arg1)
+    {
+# if defined(HIPHOP_WASM_DLL)
+        typedef own wasm_module_t* (*FuncType)(wasm_store_t*, const wasm_byte_vec_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0, arg1);
+# else
+        return ::wasm_module_deserialize(arg0, arg1);
+# endif
+    }
+#endif
+
     //
     // Import
     //
@@ -396,6 +428,16 @@ public:
 #endif
     }
 
+    inline void wasm_functype_delete(own wasm_functype_t* arg0)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef void (*FuncType)(own wasm_functype_t*);
+        DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+#else
+        ::wasm_functype_delete(arg0);
+#endif
+    }
+
     inline own wasm_func_t* wasm_func_new_with_env(wasm_store_t* arg0, const wasm_functype_t* arg1,
                                             wasm_func_callback_with_env_t arg2, void* arg3,
                                             void (*arg4)(void*))
@@ -445,6 +487,26 @@ public:
 #endif
     }
 
+    inline uint32_t wasm_memory_size(const wasm_memory_t* arg0)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef uint32_t (*FuncType)(const wasm_memory_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+#else
+        return ::wasm_memory_size(arg0);
+#endif
+    }
+
+    inline bool wasm_memory_grow(wasm_memory_t* arg0, uint32_t arg1)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef bool (*FuncType)(wasm_memory_t*, uint32_t);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0, arg1);
+#else
+        return ::wasm_memory_grow(arg0, arg1);
+#endif
+    }
+
     //
     // Global
     //
@@ -469,6 +531,36 @@ public:
 #endif
     }
 
+    inline own wasm_globaltype_t* wasm_global_type(const wasm_global_t* arg0)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef own wasm_globaltype_t* (*FuncType)(const wasm_global_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+#else
+        return ::wasm_global_type(arg0);
+#endif
+    }
+
+    inline wasm_mutability_t wasm_globaltype_mutability(const wasm_globaltype_t* arg0)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef wasm_mutability_t (*FuncType)(const wasm_globaltype_t*);
+        return DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+#else
+        return ::wasm_globaltype_mutability(arg0);
+#endif
+    }
+
+    inline void wasm_globaltype_delete(own wasm_globaltype_t* arg0)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef void (*FuncType)(own wasm_globaltype_t*);
+        DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+#else
+        ::wasm_globaltype_delete(arg0);
+#endif
+    }
+
     //
     // Trap
     //
@@ -483,6 +575,16 @@ public:
 #endif
     }
 
+    inline void wasm_trap_delete(own wasm_trap_t* arg0)
+    {
+#if defined(HIPHOP_WASM_DLL)
+        typedef void (*FuncType)(own wasm_trap_t*);
+        DLL_SYMBOL(__FUNCTION__,FuncType)(arg0);
+#else
+        ::wasm_trap_delete(arg0);
+#endif
+    }
+
 #if defined(HIPHOP_WASM_DLL)
 private:
 # if defined(DISTRHO_OS_WINDOWS)
@@ -0,0 +1,485 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#if defined(HIPHOP_WASM_MODULE_CACHE)
+# include <atomic>
+# include <cstdio>
+# if DISTRHO_OS_WINDOWS
+#  include <process.h>
+# else
+#  include <unistd.h>
+# endif
+# if defined(__aarch64__) && DISTRHO_OS_LINUX
+#  include <sys/auxv.h>
+# elif defined(__aarch64__) && DISTRHO_OS_MAC
+#  include <sys/sysctl.h>
+# endif
+#endif
+
+#include "WasmEngine.hpp"
+#include "WasmRuntime.hpp"
+
+#if defined(HIPHOP_WASM_MODULE_CACHE)
+# include "extra/Path.hpp"
+# include "MappedFile.hpp"
+# if ! defined(HIPHOP_WASM_RUNTIME_WASMER)
+#  error Compiled module cache requires Wasmer runtime
+# endif
+# define CACHE_FILE_MAGIC "HHWC"
+# define CACHE_FILE_MAGIC_SIZE 4
+#endif
+
+USE_NAMESPACE_DISTRHO
+
+// Wraps caller owned memory in a vector without copying. The C API takes the
+// binary as a borrowed const pointer, so the vector must not be deleted.
+static wasm_byte_vec_t borrowByteVec(const unsigned char* data, size_t size) noexcept
+{
+    wasm_byte_vec_t vec;
+    std::memset(&vec, 0, sizeof(vec));
+    vec.size = size;
+    vec.data = reinterpret_cast<byte_t*>(const_cast<unsigned char*>(data));
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    vec.num_elems = size;
+    vec.size_of_elem = sizeof(byte_t);
+#endif
+    return vec;
+}
+
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+// All operators cost the same, fuel approximates the number of instructions
+static uint64_t meteringCost(wasmer_parser_operator_t)
+{
+    return 1;
+}
+#endif
+
+std::shared_ptr<WasmEngine> WasmEngine::getInstance()
+{
+    // The engine lives as long as at least one runtime references it
+    static Mutex mutex;
+    static std::weak_ptr<WasmEngine> instance;
+
+    const MutexLocker locker(mutex);
+    std::shared_ptr<WasmEngine> engine = instance.lock();
+
+    if (engine == nullptr) {
+        engine = std::shared_ptr<WasmEngine>(new WasmEngine());
+        instance = engine;
+    }
+
+    return engine;
+}
+
+WasmEngine::WasmEngine()
+    : fEngine(nullptr)
+    , fStore(nullptr)
+    , fSimdSupported(-1)
+    , fDiskCacheHits(0)
+    , fDiskCacheMisses(0)
+{
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+    // Compiled code is instrumented for counting executed operators, the
+    // budget for each call is set through WasmRuntime::setFuel(). Ownership
+    // of the middleware and config passes to the engine.
+    wasm_config_t* config = wasm_config_new();
+    wasmer_metering_t* metering = wasmer_metering_new(WASM_FUEL_UNLIMITED, meteringCost);
+    wasm_config_push_middleware(config, wasmer_metering_as_middleware(metering));
+    fEngine = wasm_engine_new_with_config(config);
+#else
+    fEngine = fLib.wasm_engine_new();
+#endif
+    if (fEngine == nullptr) {
+        throw wasm_runtime_exception("wasm_engine_new() failed");
+    }
+
+    fStore = fLib.wasm_store_new(fEngine);
+    if (fStore == nullptr) {
+        fLib.wasm_engine_delete(fEngine);
+        throw wasm_runtime_exception("wasm_store_new() failed");
+    }
+}
+
+WasmEngine::~WasmEngine()
+{
+    // Modules keep a reference to the engine, none can be alive at this point
+    fModules.clear();
+
+    if (fStore != nullptr) {
+        fLib.wasm_store_delete(fStore);
+        fStore = nullptr;
+    }
+
+    if (fEngine != nullptr) {
+        fLib.wasm_engine_delete(fEngine);
+        fEngine = nullptr;
+    }
+}
+
+std::shared_ptr<WasmModule> WasmEngine::getModule(const unsigned char* data, size_t size)
+{
+    const uint64_t key = hash(data, size);
+    const Sha256Digest digest = Sha256::digest(data, size);
+
+    {
+        const MutexLocker locker(fModulesMutex);
+        const std::shared_ptr<WasmModule> module = findModule(key, digest, size);
+
+        if (module != nullptr) {
+            return module;
+        }
+    }
+
+    // Compile without holding the modules lock so lookups of already loaded
+    // binaries do not wait for a compilation. Compilations themselves are
+    // serialized because they go through the shared store. Concurrent loads
+    // of the same binary compile it more than once, the first module published
+    // wins.
+
+    wasm_module_t* wasmModule = nullptr;
+
+#if defined(HIPHOP_WASM_MODULE_CACHE)
+    wasmModule = loadCachedModule(key, size);
+
+    if (wasmModule != nullptr) {
+        fDiskCacheHits++;
+    } else {
+        fDiskCacheMisses++;
+    }
+#endif
+
+    if (wasmModule == nullptr) {
+        const wasm_byte_vec_t moduleBytes = borrowByteVec(data, size);
+
+        // Following call crashes some DAWs on Windows when running Wasmer runtime.
+        {
+            const MutexLocker locker(fStoreMutex);
+            wasmModule = fLib.wasm_module_new(fStore, &moduleBytes);
+        }
+
+        if (wasmModule == nullptr) {
+            throw wasm_runtime_exception("wasm_module_new() failed");
+        }
+
+#if defined(HIPHOP_WASM_MODULE_CACHE)
+        storeCachedModule(key, size, wasmModule);
+#endif
+    }
+
+    std::shared_ptr<WasmModule> module = std::make_shared<WasmModule>(shared_from_this(), wasmModule,
+                                                                      key, digest, size);
+    const MutexLocker locker(fModulesMutex);
+    const std::shared_ptr<WasmModule> published = findModule(key, digest, size);
+
+    if (published != nullptr) {
+        return published;
+    }
+
+    fModules.insert(std::make_pair(key, module));
+
+    return module;
+}
+
+std::shared_ptr<WasmModule> WasmEngine::findModule(uint64_t key, const Sha256Digest& digest, size_t size)
+{
+    // Called with fModulesMutex held. A 64-bit hash match alone is not proof
+    // of the same binary, size and SHA-256 digest are compared too, no copy of
+    // the binary is kept. Expired entries are purged.
+
+    std::shared_ptr<WasmModule> module;
+    ModuleMap::iterator it = fModules.begin();
+
+    while (it != fModules.end()) {
+        if ((module == nullptr) && (it->first == key)) {
+            const std::shared_ptr<WasmModule> candidate = it->second.lock();
+
+            if ((candidate != nullptr) && candidate->matches(digest, size)) {
+                module = candidate;
+            }
+        }
+
+        if (it->second.expired()) {
+            it = fModules.erase(it);
+        } else {
+            ++it;
+        }
+    }
+
+    return module;
+}
+
+uint64_t WasmEngine::hash(const unsigned char* data, size_t size) noexcept
+{
+    // 64-bit FNV-1a, the size is mixed in to further reduce collisions
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ data[i]) * 0x100000001b3ULL;
+    }
+
+    return (h ^ static_cast<uint64_t>(size)) * 0x100000001b3ULL;
+}
+
+bool WasmEngine::isSimdSupported()
+{
+    const MutexLocker locker(fModulesMutex);
+
+    if (fSimdSupported != -1) {
+        return fSimdSupported == 1;
+    }
+
+#if defined(HIPHOP_WASM_RUNTIME_WAMR) && defined(HIPHOP_WASM_BINARY_COMPILED)
+    // AOT builds cannot load bytecode for probing. SIMD support is fixed when
+    // building the runtime, loading a SIMD AOT binary fails if not available.
+# if defined(HIPHOP_WASM_SIMD)
+    fSimdSupported = 1;
+# else
+    fSimdSupported = 0;
+# endif
+#else
+    // (module (func (result v128) v128.const i32x4 0 0 0 0))
+    static const unsigned char probe[] = {
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00,
+        0x01, 0x05, 0x01, 0x60, 0x00, 0x01, 0x7b,
+        0x03, 0x02, 0x01, 0x00,
+        0x0a, 0x16, 0x01, 0x14, 0x00, 0xfd, 0x0c,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x0b
+    };
+
+    const wasm_byte_vec_t probeBytes = borrowByteVec(probe, sizeof(probe));
+    const MutexLocker storeLocker(fStoreMutex);
+    fSimdSupported = fLib.wasm_module_validate(fStore, &probeBytes) ? 1 : 0;
+#endif
+
+    return fSimdSupported == 1;
+}
+
+#if defined(HIPHOP_WASM_MODULE_CACHE)
+
+// Cache file layout: magic, key size (u32), key, payload checksum (u64) and
+// the payload produced by wasm_module_serialize(). Any mismatch deletes the
+// file, deserializing untrusted data is not safe.
+
+wasm_module_t* WasmEngine::loadCachedModule(uint64_t hash, size_t size)
+{
+    const String path = getCacheFilePath(hash);
+
+    if (path.isEmpty()) {
+        return nullptr;
+    }
+
+    wasm_module_t* module = nullptr;
+
+    {
+        const MappedFile file (path);
+
+        if (! file.isValid()) {
+            return nullptr;
+        }
+
+        const String key = getCacheKey(hash, size);
+        const uint32_t keySize = static_cast<uint32_t>(key.length());
+        const size_t headerSize = CACHE_FILE_MAGIC_SIZE + sizeof(uint32_t) + keySize + sizeof(uint64_t);
+        const unsigned char* contents = file.getData();
+
+        bool valid = (file.getSize() > headerSize)
+                        && (std::memcmp(contents, CACHE_FILE_MAGIC, CACHE_FILE_MAGIC_SIZE) == 0);
+
+        if (valid) {
+            uint32_t storedKeySize;
+            std::memcpy(&storedKeySize, contents + CACHE_FILE_MAGIC_SIZE, sizeof(uint32_t));
+            const unsigned char* storedKey = contents + CACHE_FILE_MAGIC_SIZE + sizeof(uint32_t);
+
+            valid = (storedKeySize == keySize) && (std::memcmp(storedKey, key.buffer(), keySize) == 0);
+        }
+
+        if (valid) {
+            const unsigned char* payload = contents + headerSize;
+            const size_t payloadSize = file.getSize() - headerSize;
+
+            uint64_t checksum;
+            std::memcpy(&checksum, payload - sizeof(uint64_t), sizeof(uint64_t));
+
+            if (checksum == WasmEngine::hash(payload, payloadSize)) {
+                const wasm_byte_vec_t serialized = borrowByteVec(payload, payloadSize);
+                const MutexLocker locker(fStoreMutex);
+                module = fLib.wasm_module_deserialize(fStore, &serialized);
+            }
+        }
+    }
+
+    if (module == nullptr) {
+        // Stale runtime version, different CPU or corrupted file. The mapping
+        // is already released, Windows does not allow deleting mapped files.
+        std::remove(path);
+    }
+
+    return module;
+}
+
+void WasmEngine::storeCachedModule(uint64_t hash, size_t size, const wasm_module_t* module)
+{
+    const String path = getCacheFilePath(hash);
+
+    if (path.isEmpty()) {
+        return;
+    }
+
+    wasm_byte_vec_t serialized;
+    serialized.size = 0;
+    fLib.wasm_module_serialize(module, &serialized);
+
+    if (serialized.size == 0) {
+        return;
+    }
+
+    const String key = getCacheKey(hash, size);
+    const uint32_t keySize = static_cast<uint32_t>(key.length());
+    const uint64_t checksum = WasmEngine::hash(reinterpret_cast<const unsigned char*>(serialized.data),
+                                               serialized.size);
+
+    // Write to a temporary file first so other processes never see partial data.
+    // The name must be unique across processes and across concurrent stores
+    // within the same process.
+    static std::atomic<uint32_t> tmpCounter(0);
+#if DISTRHO_OS_WINDOWS
+    const unsigned long pid = static_cast<unsigned long>(_getpid());
+#else
+    const unsigned long pid = static_cast<unsigned long>(getpid());
+#endif
+    char suffix[48];
+    std::snprintf(suffix, sizeof(suffix), ".%lu-%u.tmp", pid, tmpCounter++);
+    const String tmpPath = path + suffix;
+
+    std::FILE* file = std::fopen(tmpPath, "wb");
+
+    if (file != nullptr) {
+        bool ok = std::fwrite(CACHE_FILE_MAGIC, 1, CACHE_FILE_MAGIC_SIZE, file) == CACHE_FILE_MAGIC_SIZE;
+        ok = ok && (std::fwrite(&keySize, sizeof(keySize), 1, file) == 1);
+        ok = ok && (std::fwrite(key.buffer(), 1, keySize, file) == keySize);
+        ok = ok && (std::fwrite(&checksum, sizeof(checksum), 1, file) == 1);
+        ok = ok && (std::fwrite(serialized.data, 1, serialized.size, file) == serialized.size);
+        ok = (std::fclose(file) == 0) && ok;
+
+        if (ok) {
+            std::remove(path); // rename() does not overwrite on Windows
+            ok = std::rename(tmpPath, path) == 0;
+        }
+
+        if (! ok) {
+            std::remove(tmpPath);
+        }
+    }
+
+    fLib.wasm_byte_vec_delete(&serialized);
+}
+
+String WasmEngine::getCacheFilePath(uint64_t hash)
+{
+    const String dir = Path::getUserData();
+
+    if (dir.isEmpty()) {
+        return String();
+    }
+
+    char name[32];
+    std::snprintf(name, sizeof(name), "module-%016llx.bin", static_cast<unsigned long long>(hash));
+
+    return dir + DISTRHO_OS_SEP_STR + name;
+}
+
+String WasmEngine::getCacheKey(uint64_t hash, size_t size)
+{
+    // Serialized modules contain native code, they are only valid for the
+    // exact runtime version and CPU features they were compiled with
+    char key[128];
+    std::snprintf(key, sizeof(key), "%016llx %llu wasmer-" WASMER_VERSION " ",
+                  static_cast<unsigned long long>(hash), static_cast<unsigned long long>(size));
+
+    String s = String(key);
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    s += "x86";
+# define APPEND_CPU_FEATURE(f) if (__builtin_cpu_supports(f)) { s += "+" f; }
+    APPEND_CPU_FEATURE("sse4.1")
+    APPEND_CPU_FEATURE("sse4.2")
+    APPEND_CPU_FEATURE("popcnt")
+    APPEND_CPU_FEATURE("avx")
+    APPEND_CPU_FEATURE("avx2")
+    APPEND_CPU_FEATURE("fma")
+    APPEND_CPU_FEATURE("bmi")
+    APPEND_CPU_FEATURE("bmi2")
+    APPEND_CPU_FEATURE("avx512f")
+# undef APPEND_CPU_FEATURE
+#elif defined(__aarch64__)
+    s += "aarch64";
+# if DISTRHO_OS_LINUX
+    // Feature bits as reported by the kernel, covers LSE, SVE, dot product etc.
+    char hwcap[48];
+    std::snprintf(hwcap, sizeof(hwcap), "+%lx+%lx", getauxval(AT_HWCAP), getauxval(AT_HWCAP2));
+    s += hwcap;
+# elif DISTRHO_OS_MAC
+    // Apple does not expose feature bits, the CPU model determines them
+    char brand[128];
+    size_t brandSize = sizeof(brand);
+
+    if (sysctlbyname("machdep.cpu.brand_string", brand, &brandSize, nullptr, 0) == 0) {
+        brand[sizeof(brand) - 1] = '\0';
+        s += "+";
+        s += brand;
+    }
+# endif
+#else
+    s += "unknown";
+#endif
+
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+    s += " metering";
+#endif
+
+    return s;
+}
+
+#endif // HIPHOP_WASM_MODULE_CACHE
+
+WasmModule::WasmModule(std::shared_ptr<WasmEngine> engine, own wasm_module_t* module, uint64_t hash,
+                       const Sha256Digest& digest, size_t size) noexcept
+    : fEngine(engine)
+    , fModule(module)
+    , fHash(hash)
+    , fDigest(digest)
+    , fSize(size)
+{}
+
+WasmModule::~WasmModule()
+{
+    // Expired entries are purged from the engine map by the next getModule().
+    // The module was created through the engine store, last references can be
+    // dropped on any thread.
+    const MutexLocker locker(fEngine->fStoreMutex);
+    fEngine->fLib.wasm_module_delete(fModule);
+}
+
+bool WasmModule::matches(const Sha256Digest& digest, size_t size) const noexcept
+{
+    return (fSize == size) && (fDigest == digest);
+}
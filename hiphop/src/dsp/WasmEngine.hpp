@@ -0,0 +1,128 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WASM_ENGINE_HPP
+#define WASM_ENGINE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+
+#include "src/DistrhoDefines.h"
+#include "distrho/extra/LeakDetector.hpp"
+#include "distrho/extra/Mutex.hpp"
+#include "distrho/extra/String.hpp"
+
+#include "Sha256.hpp"
+#include "WasmCApi.hpp"
+
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+# define WASM_FUEL_UNLIMITED UINT64_MAX
+#endif
+
+START_NAMESPACE_DISTRHO
+
+class WasmModule;
+
+// Process-wide engine shared by all WasmRuntime instances. Plugin instances
+// loaded from the same binary share a single compiled module and only create
+// their own store and instance. Modules are compiled against a store owned by
+// the engine; both supported runtimes allow instantiating them in any store
+// created from the same engine. Stores are not thread-safe, every use of the
+// engine store is serialized by fStoreMutex.
+// When HIPHOP_WASM_MODULE_CACHE is defined compiled modules are also persisted
+// to the user data directory, so later processes can skip compilation.
+
+class WasmEngine : public std::enable_shared_from_this<WasmEngine>
+{
+public:
+    static std::shared_ptr<WasmEngine> getInstance();
+
+    ~WasmEngine();
+
+    wasm_engine_t* getEngine() noexcept { return fEngine; }
+
+    std::shared_ptr<WasmModule> getModule(const unsigned char* data, size_t size);
+
+    static uint64_t hash(const unsigned char* data, size_t size) noexcept;
+
+    bool isSimdSupported();
+
+    uint32_t getDiskCacheHits() const noexcept { return fDiskCacheHits; }
+    uint32_t getDiskCacheMisses() const noexcept { return fDiskCacheMisses; }
+
+private:
+    friend class WasmModule;
+
+    WasmEngine();
+
+    std::shared_ptr<WasmModule> findModule(uint64_t key, const Sha256Digest& digest, size_t size);
+
+#if defined(HIPHOP_WASM_MODULE_CACHE)
+    wasm_module_t* loadCachedModule(uint64_t hash, size_t size);
+    void           storeCachedModule(uint64_t hash, size_t size, const wasm_module_t* module);
+
+    static String getCacheFilePath(uint64_t hash);
+    static String getCacheKey(uint64_t hash, size_t size);
+#endif
+
+    // Keyed by hash, colliding binaries get their own entries
+    typedef std::unordered_multimap<uint64_t, std::weak_ptr<WasmModule>> ModuleMap;
+
+    WasmCApi       fLib;
+    wasm_engine_t* fEngine;
+    wasm_store_t*  fStore;
+    Mutex          fStoreMutex;
+    Mutex          fModulesMutex;
+    ModuleMap      fModules;
+    int            fSimdSupported; // -1 until probed
+
+    std::atomic<uint32_t> fDiskCacheHits;
+    std::atomic<uint32_t> fDiskCacheMisses;
+
+    DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WasmEngine)
+
+};
+
+class WasmModule
+{
+public:
+    WasmModule(std::shared_ptr<WasmEngine> engine, own wasm_module_t* module, uint64_t hash,
+               const Sha256Digest& digest, size_t size) noexcept;
+    ~WasmModule();
+
+    wasm_module_t* get() const noexcept { return fModule; }
+    uint64_t       getHash() const noexcept { return fHash; }
+
+    bool matches(const Sha256Digest& digest, size_t size) const noexcept;
+
+private:
+    std::shared_ptr<WasmEngine> fEngine;
+    wasm_module_t*              fModule;
+    uint64_t                    fHash;
+    Sha256Digest                fDigest; // for telling hash collisions apart
+    size_t                      fSize;
+
+    DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WasmModule)
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // WASM_ENGINE_HPP
@@ -16,20 +16,54 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <chrono>
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <stdexcept>
 
 #include "WasmPluginImpl.hpp"
+#include "AllocationGuard.hpp"
 #include "extra/Path.hpp"
+#include "distrho/extra/Sleep.hpp"
 
 #if defined(HIPHOP_WASM_BINARY_COMPILED)
 # if defined(__arm__)
 #  define WASM_BINARY_FILE "aarch64.aot"
+#  define WASM_SIMD_BINARY_FILE "aarch64-simd.aot"
 # else
 #  define WASM_BINARY_FILE "x86_64.aot"
+#  define WASM_SIMD_BINARY_FILE "x86_64-simd.aot"
 # endif
 #else
 # define WASM_BINARY_FILE "optimized.wasm"
+# define WASM_SIMD_BINARY_FILE "optimized-simd.wasm"
+#endif
+#define MAX_BINARY_CANDIDATES 2
+
+#define ERROR_STR "Error"
+
+// Must match MAX_AUDIO_BLOCK_BYTES, MAX_MIDI_OUT_BYTES, MAX_PARAM_EVENTS and
+// TIME_POSITION_BYTES in index.ts
+#define MAX_AUDIO_BLOCK_BYTES 65536
+#define MAX_MIDI_OUTPUT_BYTES 6144
+#define MAX_PARAMETER_EVENTS 512
+#define TIME_POSITION_BYTES 64
+
+#if DISTRHO_PLUGIN_NUM_INPUTS > DISTRHO_PLUGIN_NUM_OUTPUTS
+# define MAX_AUDIO_CHANNELS DISTRHO_PLUGIN_NUM_INPUTS
+#elif DISTRHO_PLUGIN_NUM_OUTPUTS > 0
+# define MAX_AUDIO_CHANNELS DISTRHO_PLUGIN_NUM_OUTPUTS
+#else
+# define MAX_AUDIO_CHANNELS 1
+#endif
+
+#define MAX_AUDIO_BLOCK_FRAMES (MAX_AUDIO_BLOCK_BYTES / 4 / MAX_AUDIO_CHANNELS)
+
+#if (HIPHOP_WASM_BLOCK_SIZE > 0) && (HIPHOP_WASM_BLOCK_SIZE < MAX_AUDIO_BLOCK_FRAMES)
+# define BLOCK_FRAMES HIPHOP_WASM_BLOCK_SIZE
+#else
+# define BLOCK_FRAMES MAX_AUDIO_BLOCK_FRAMES
 #endif
 
 USE_NAMESPACE_DISTRHO
@@ -37,96 +71,158 @@ USE_NAMESPACE_DISTRHO
 WasmPlugin::WasmPlugin(uint32_t parameterCount, uint32_t programCount, uint32_t stateCount,
                                 std::shared_ptr<WasmRuntime> runtime)
     : PluginEx(parameterCount, programCount, stateCount)
+    , fLabel(ERROR_STR)
+    , fMaker(ERROR_STR)
+    , fLicense(ERROR_STR)
+    , fVersion(0)
+    , fUniqueId(0)
+    , fParameterCount(parameterCount)
+    , fProgramCount(programCount)
+    , fStateCount(stateCount)
     , fActive(false)
+    , fHandles()
+    , fParameterValues(new std::atomic<float>[parameterCount])
+    , fParameterChangedBits(new std::atomic<uint32_t>[(parameterCount + 31) / 32])
+    , fParameterChangedWords((parameterCount + 31) / 32)
+    , fParameterChanged(false)
+    , fMidiPendingRead(0)
+    , fMidiPendingWrite(0)
+    , fMidiDroppedEventCount(0)
+    , fMidiOutputDroppedEventCount(0)
+    , fMemoryGrowBlockCount(0)
+    , fFaulted(false)
+    , fTrapCount(0)
+    , fOverrunCount(0)
+    , fConsecutiveOverruns(0)
+    , fOverrunSkipCount(0)
+#if HIPHOP_WASM_VOICE_WORKERS
+    , fVoiceFrames(0)
+    , fVoiceParameterEventCount(0)
+    , fVoiceNextShard(0)
+#endif
+#if defined(HIPHOP_WASM_GC_STATS)
+    , fGcBlockCount(0)
+    , fGcTimeNs(0)
+    , fGcMaxTimeNs(0)
+#endif
+#if HIPHOP_SHARED_MEMORY_SIZE
+    , fLoaderThread(this)
+    , fLoaderStarted(false)
+    , fPendingBinarySequence(0)
+    , fPendingBinarySize(0)
+    , fLoadedBinarySequence(0)
+    , fPendingInstance(nullptr)
+    , fRetiredInstance(nullptr)
+# if HIPHOP_HOTSWAP_CROSSFADE_MS
+    , fFadingInstance(nullptr)
+    , fFadePosition(0)
+    , fFadeLength(0)
+    , fFadeBlockCount(0)
+    , fFadeTimeNs(0)
+# endif
+#endif
 {   
+    for (uint32_t i = 0; i < parameterCount; i++) {
+        fParameterValues[i].store(0);
+    }
+
+    for (uint32_t i = 0; i < fParameterChangedWords; i++) {
+        fParameterChangedBits[i].store(0);
+    }
+
     if (runtime != nullptr) {
         fRuntime = runtime;
+
+        if (fRuntime->hasInstance()) {
+            resolveHandles(*fRuntime, fHandles);
+            loadMetadata();
+            loadDescriptors();
+        }
+
         return; // caller initializes runtime
     }
 
     fRuntime.reset(new WasmRuntime());
 
     try {
-        const String path = Path::getPluginLibrary() + "/dsp/" WASM_BINARY_FILE;
-        fRuntime->load(path);
+        const String dir = Path::getPluginLibrary() + "/dsp/";
+        const char* candidates[MAX_BINARY_CANDIDATES];
+        int count = 0;
+
+        // Ordered by preference, first binary that loads on this machine wins
+#if defined(HIPHOP_WASM_SIMD)
+        if (fRuntime->isSimdSupported()) {
+            candidates[count++] = WASM_SIMD_BINARY_FILE;
+        }
+#endif
+        candidates[count++] = WASM_BINARY_FILE;
+
+        for (int i = 0; i < count; i++) {
+            try {
+                fRuntime->load(dir + candidates[i]);
+
+                if (i > 0) {
+                    d_stderr("Using fallback DSP binary %s (%s)", candidates[i],
+                                fRuntime->getModeName());
+                }
+
+                break;
+            } catch (const std::exception& ex) {
+                if (i == count - 1) {
+                    throw;
+                }
+
+                d_stderr2(ex.what()); // try next candidate
+            }
+        }
+
         onModuleLoad();
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
 }
 
-#define ERROR_STR "Error"
+WasmPlugin::~WasmPlugin()
+{
+#if HIPHOP_SHARED_MEMORY_SIZE
+    if (fLoaderStarted) {
+        fLoaderThread.stop();
+    }
+
+    delete fPendingInstance.exchange(nullptr);
+    delete fRetiredInstance.exchange(nullptr);
+# if HIPHOP_HOTSWAP_CROSSFADE_MS
+    delete fFadingInstance;
+# endif
+#endif
+}
+
 #define CHECK_INSTANCE() checkInstance(__FUNCTION__)
 #define SCOPED_RUNTIME_LOCK() ScopedSpinLock lock(fRuntimeLock)
 
 const char* WasmPlugin::getLabel() const
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        return fRuntime->callFunctionReturnCString("get_label");
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
-
-        return ERROR_STR;
-    }
+    return fLabel;
 }
 
 const char* WasmPlugin::getMaker() const
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        return fRuntime->callFunctionReturnCString("get_maker");
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
-
-        return ERROR_STR;
-    }
+    return fMaker;
 }
 
 const char* WasmPlugin::getLicense() const
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        return fRuntime->callFunctionReturnCString("get_license");
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
-
-        return ERROR_STR;
-    }
+    return fLicense;
 }
 
 uint32_t WasmPlugin::getVersion() const
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        return fRuntime->callFunctionReturnSingleValue("get_version").of.i32;
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
-
-        return 0;
-    }
+    return fVersion;
 }
 
 int64_t WasmPlugin::getUniqueId() const
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        return fRuntime->callFunctionReturnSingleValue("get_unique_id").of.i64;
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
-
-        return 0;
-    }
+    return fUniqueId;
 }
 
 // VST3
@@ -138,68 +234,68 @@ void WasmPlugin::initAudioPort(const bool input, uint32_t index, AudioPort& port
 
 void WasmPlugin::initParameter(uint32_t index, Parameter& parameter)
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
+    if (index >= fParameterDescriptors.size()) {
+        return;
+    }
 
-        fRuntime->callFunction("init_parameter", { MakeI32(index) });
-        parameter.hints      = fRuntime->getGlobal("_rw_int32_0").of.i32;
-        parameter.name       = fRuntime->getGlobalAsCString("_ro_string_0");
-        parameter.ranges.def = fRuntime->getGlobal("_rw_float32_0").of.f32;
-        parameter.ranges.min = fRuntime->getGlobal("_rw_float32_1").of.f32;
-        parameter.ranges.max = fRuntime->getGlobal("_rw_float32_2").of.f32;
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
+    const ParameterDescriptor& descriptor = fParameterDescriptors[index];
+
+    parameter.hints      = descriptor.hints;
+    parameter.name       = descriptor.name;
+    parameter.ranges.def = descriptor.def;
+    parameter.ranges.min = descriptor.min;
+    parameter.ranges.max = descriptor.max;
+
+    fParameterValues[index].store(descriptor.def);
+
+    if (descriptor.hints & kParameterIsOutput) {
+        fOutputParameters.push_back(index);
     }
 }
 
 float WasmPlugin::getParameterValue(uint32_t index) const
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        return fRuntime->callFunctionReturnSingleValue("get_parameter_value",
-            { MakeI32(index) }).of.f32;
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
-
+    if (index >= fParameterCount) {
         return 0;
     }
+
+    return fParameterValues[index].load(std::memory_order_relaxed);
 }
 
 void WasmPlugin::setParameterValue(uint32_t index, float value)
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        fRuntime->callFunction("set_parameter_value", { MakeI32(index), MakeF32(value) });
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
+    if (index >= fParameterCount) {
+        return;
     }
+
+    // Value first, the audio thread reads it after clearing the bit
+    fParameterValues[index].store(value, std::memory_order_relaxed);
+    fParameterChangedBits[index / 32].fetch_or(1u << (index % 32), std::memory_order_release);
+    fParameterChanged.store(true, std::memory_order_release);
 }
 
 #if DISTRHO_PLUGIN_WANT_PROGRAMS
 void WasmPlugin::initProgramName(uint32_t index, String& programName)
 {
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        programName = fRuntime->callFunctionReturnCString("init_program_name", { MakeI32(index) });
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
+    if (index < fProgramNames.size()) {
+        programName = fProgramNames[index];
     }
 }
 
 void WasmPlugin::loadProgram(uint32_t index)
 {
     try {
-        CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
+        CHECK_INSTANCE();
 
+        applyParameterChanges();
         fRuntime->callFunction("load_program", { MakeI32(index) });
+#if HIPHOP_WASM_VOICE_WORKERS
+        for (size_t i = 1; i < fVoiceShards.size(); i++) {
+            fVoiceShards[i].runtime->callFunction("load_program", { MakeI32(index) });
+        }
+#endif
+        refreshParameterValues();
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
     }
@@ -210,27 +306,19 @@ void WasmPlugin::loadProgram(uint32_t index)
 void WasmPlugin::initState(uint32_t index, State& state)
 {
     PluginEx::initState(index, state);
-    
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
 
-        fRuntime->callFunction("init_state", { MakeI32(index) });
-        const char* key = fRuntime->getGlobalAsCString("_ro_string_0");
+    // Do not overwrite PluginEx internal states
+    if ((index >= fStateDescriptors.size()) || fStateDescriptors[index].key.isEmpty()) {
+        return;
+    }
 
-        // Do not overwrite PluginEx internal states
-        if (std::strlen(key) == 0) {
-            return;
-        }
+    const StateDescriptor& descriptor = fStateDescriptors[index];
 
-        state.key          = key;
-        state.defaultValue = fRuntime->getGlobalAsCString("_ro_string_1");
-        state.label        = fRuntime->getGlobalAsCString("_ro_string_2");
-        state.description  = fRuntime->getGlobalAsCString("_ro_string_3");
-        state.hints        = fRuntime->getGlobal("_rw_int32_0").of.i32;
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
-    }
+    state.key          = descriptor.key;
+    state.defaultValue = descriptor.defaultValue;
+    state.label        = descriptor.label;
+    state.description  = descriptor.description;
+    state.hints        = descriptor.hints;
 }
 
 void WasmPlugin::setState(const char* key, const char* value)
@@ -238,8 +326,21 @@ void WasmPlugin::setState(const char* key, const char* value)
     PluginEx::setState(key, value);
 
     try {
-        CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
+        CHECK_INSTANCE();
+
+        applyParameterChanges();
+
+#if HIPHOP_WASM_VOICE_WORKERS
+        for (size_t i = 1; i < fVoiceShards.size(); i++) {
+            WasmRuntime& runtime = *fVoiceShards[i].runtime;
+            const WasmValue wkey = runtime.getGlobal("_rw_string_0");
+            runtime.copyCStringToMemory(wkey, key);
+            const WasmValue wval = runtime.getGlobal("_rw_string_1");
+            runtime.copyCStringToMemory(wval, value);
+            runtime.callFunction("set_state", { wkey, wval });
+        }
+#endif
 
         const WasmValue wkey = fRuntime->getGlobal("_rw_string_0");
         fRuntime->copyCStringToMemory(wkey, key);
@@ -255,8 +356,10 @@ void WasmPlugin::setState(const char* key, const char* value)
 String WasmPlugin::getState(const char* key) const
 {
     try {
-        CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
+        CHECK_INSTANCE();
+
+        const_cast<WasmPlugin*>(this)->applyParameterChanges();
 
         const WasmValue wkey = fRuntime->getGlobal("_rw_string_0");
         fRuntime->copyCStringToMemory(wkey, key);
@@ -275,11 +378,42 @@ String WasmPlugin::getState(const char* key) const
 
 void WasmPlugin::activate()
 {
+#if HIPHOP_SHARED_MEMORY_SIZE && HIPHOP_HOTSWAP_CROSSFADE_MS
+    // Output of the replaced instance during a hot-swap crossfade
+    fFadeBuffer.resize(DISTRHO_PLUGIN_NUM_OUTPUTS * getBufferSize());
+#endif
+
     try {
-        CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
+        CHECK_INSTANCE();
+
+        // Same size requested for the module MIDI block in createInstance()
+        fMidiInput.resize(HIPHOP_WASM_MIDI_BUFFER_SIZE);
+        fMidiPending.resize(HIPHOP_WASM_SYSEX_BUFFER_SIZE);
+        fMidiPendingRead = 0;
+        fMidiPendingWrite = 0;
+
+        // Give a faulted module another chance, activate() is expected to
+        // reset its state
+        fFaulted = false;
+        fConsecutiveOverruns = 0;
+        fOverrunSkipCount = 0;
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+        fRuntime->setFuel(WASM_FUEL_UNLIMITED);
+#endif
 
+        applyParameterChanges();
         fRuntime->callFunction("activate");
+#if HIPHOP_WASM_VOICE_WORKERS
+        for (size_t i = 1; i < fVoiceShards.size(); i++) {
+# if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+            fVoiceShards[i].runtime->setFuel(WASM_FUEL_UNLIMITED);
+# endif
+            fVoiceShards[i].runtime->callFunction("activate");
+        }
+
+        resetVoiceRouting();
+#endif
         fActive = true;
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
@@ -289,10 +423,16 @@ void WasmPlugin::activate()
 void WasmPlugin::deactivate()
 {
     try {
-        CHECK_INSTANCE();
         SCOPED_RUNTIME_LOCK();
+        CHECK_INSTANCE();
 
+        applyParameterChanges();
         fRuntime->callFunction("deactivate");
+#if HIPHOP_WASM_VOICE_WORKERS
+        for (size_t i = 1; i < fVoiceShards.size(); i++) {
+            fVoiceShards[i].runtime->callFunction("deactivate");
+        }
+#endif
         fActive = false;
     } catch (const std::exception& ex) {
         d_stderr2(ex.what());
@@ -310,160 +450,1328 @@ void WasmPlugin::deactivate()
     uint32_t midiEventCount = 0;
 #endif // DISTRHO_PLUGIN_WANT_MIDI_INPUT
     try {
-        CHECK_INSTANCE();
+        SCOPED_ALLOCATION_GUARD();
         SCOPED_RUNTIME_LOCK();
+#if HIPHOP_SHARED_MEMORY_SIZE
+        adoptPendingInstance();
+#endif
+        CHECK_INSTANCE();
 
-        float32_t* audioBlock;
-
-        audioBlock = reinterpret_cast<float32_t *>(fRuntime->getMemory(
-            fRuntime->getGlobal("_rw_input_block")));
+        if (fFaulted) {
+            writeSilence(outputs, frames);
+            return;
+        }
 
-        for (int i = 0; i < DISTRHO_PLUGIN_NUM_INPUTS; i++) {
-            memcpy(audioBlock + i * frames, inputs[i], frames * 4);
+#if HIPHOP_WASM_CPU_BUDGET
+        if (fOverrunSkipCount > 0) {
+            fOverrunSkipCount--;
+            writeSilence(outputs, frames);
+            return;
         }
+#endif
 
-        byte_t* midiBlock = fRuntime->getMemory(fRuntime->getGlobal("_rw_midi_block"));
+#if HIPHOP_WASM_CPU_BUDGET
+        const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+#endif
 
-        for (uint32_t i = 0; i < midiEventCount; i++) {
-            *reinterpret_cast<uint32_t *>(midiBlock) = midiEvents[i].frame;
-            midiBlock += 4;
-            *reinterpret_cast<uint32_t *>(midiBlock) = midiEvents[i].size;
-            midiBlock += 4;
-            if (midiEvents[i].size > MidiEvent::kDataSize) {
-                memcpy(midiBlock, midiEvents[i].dataExt, midiEvents[i].size);
-            } else {
-                memcpy(midiBlock, midiEvents[i].data, midiEvents[i].size);
+        try {
+            runBuffer(inputs, outputs, frames, midiEvents, midiEventCount);
+        } catch (const std::exception&) {
+            if (! fFaulted) {
+                onRunFault(*fRuntime); // voice shards report their own faults
             }
-            midiBlock += midiEvents[i].size;
-        }
 
-        fRuntime->callFunction("run", { MakeI32(frames), MakeI32(midiEventCount) });
+            writeSilence(outputs, frames);
+            return;
+        }
 
-        audioBlock = reinterpret_cast<float32_t *>(fRuntime->getMemory(
-            fRuntime->getGlobal("_rw_output_block")));
+#if HIPHOP_WASM_CPU_BUDGET
+        const uint64_t elapsedNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - t0).count();
 
-        for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
-            memcpy(outputs[i], audioBlock + i * frames, frames * 4);
+        if (! checkCpuBudget(frames, elapsedNs)) {
+            writeSilence(outputs, frames);
         }
-    } catch (const std::exception& ex) {
-        //d_stderr2(ex.what());
+#endif
+    } catch (const std::exception&) {
+        writeSilence(outputs, frames);
     }
 }
 
-#if HIPHOP_SHARED_MEMORY_SIZE
-void WasmPlugin::sharedMemoryChanged(const unsigned char* data, size_t size, uint32_t hints)
+void WasmPlugin::runBuffer(const float** inputs, float** outputs, uint32_t frames,
+                            const MidiEvent* midiEvents, uint32_t midiEventCount)
 {
-    if (hints & (kShMemHintInternal | kShMemHintWasmBinary)) {
-        try {
-            loadWasmBinary(data, size);
-        } catch (const std::exception& ex) {
-            d_stderr2(ex.what());
+    // Called with fRuntimeLock held from run()
+
+    uint32_t parameterEventCount = writeParameterEvents();
+
+    // Split host buffers into sub-blocks that fit the module audio blocks.
+    // MIDI events are sorted by frame and re-timed relative to each block,
+    // parameter events are all at frame 0 and go with the first block.
+    const float* blockInputs[DISTRHO_PLUGIN_NUM_INPUTS + 1];
+    float* blockOutputs[DISTRHO_PLUGIN_NUM_OUTPUTS + 1];
+    uint32_t offset = 0;
+
+    while (offset < frames) {
+        const uint32_t blockFrames = std::min<uint32_t>(frames - offset, BLOCK_FRAMES);
+        const uint32_t blockEnd = offset + blockFrames;
+        uint32_t blockMidiEventCount = 0;
+
+        for (int i = 0; i < DISTRHO_PLUGIN_NUM_INPUTS; i++) {
+            blockInputs[i] = inputs[i] + offset;
+        }
+
+        for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
+            blockOutputs[i] = outputs[i] + offset;
+        }
+
+        // Events with out of range frames go with the last block
+        while ((blockMidiEventCount < midiEventCount)
+                && ((blockEnd == frames) || (midiEvents[blockMidiEventCount].frame < blockEnd))) {
+            blockMidiEventCount++;
         }
+
+        runBlock(blockInputs, blockOutputs, blockFrames, offset, midiEvents, blockMidiEventCount,
+                    parameterEventCount);
+#if DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
+        writeMidiOutput(blockFrames, offset);
+#endif
+
+        midiEvents += blockMidiEventCount;
+        midiEventCount -= blockMidiEventCount;
+        parameterEventCount = 0;
+        offset = blockEnd;
     }
+
+    updateOutputParameters();
 }
 
-void WasmPlugin::loadWasmBinary(const unsigned char* data, size_t size)
+void WasmPlugin::onRunFault(WasmRuntime& runtime)
 {
-    // No need to check if the runtime is running
-    SCOPED_RUNTIME_LOCK();
+    // Called with fRuntimeLock held from run(). A trap can leave the module
+    // halfway through updating its state, including the AS heap, so it is not
+    // entered again from run() until activate() or a hot-swap resets it.
+
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+    if (runtime.isFuelExhausted()) {
+        fOverrunCount++;
+    } else {
+        fTrapCount++;
+    }
+
+    runtime.setFuel(WASM_FUEL_UNLIMITED); // keep other entry points working
+#else
+    (void)runtime;
+    fTrapCount++;
+#endif
 
-    fRuntime->load(data, size);
-    onModuleLoad();
+    fFaulted = true;
+}
 
-    // This has no effect on the host parameters but might be needed by the
-    // plugin code to properly initialize.
-    for (uint32_t i = 0; i < 128; ++i) {
-        fRuntime->callFunction("init_parameter", { MakeI32(i) });
+#if HIPHOP_WASM_CPU_BUDGET
+bool WasmPlugin::checkCpuBudget(uint32_t frames, uint64_t elapsedNs)
+{
+    // Module returned but took too long. The output is late anyway, replacing
+    // it with silence avoids sending a block the host may already have
+    // dropped. A module that keeps overrunning is skipped for a while for
+    // freeing the CPU for the rest of the host graph. Its state is intact, so
+    // unlike after a trap it gets to run again and recovers when back within
+    // budget. The count is not reset while skipping, a single overrun after
+    // that skips again.
+
+    const double budgetNs = 1e7 * HIPHOP_WASM_CPU_BUDGET * frames / getSampleRate();
+
+    if (static_cast<double>(elapsedNs) <= budgetNs) {
+        fConsecutiveOverruns = 0;
+        return true;
     }
 
-    if (fActive) {
-        fRuntime->callFunction("activate");
+    fOverrunCount++;
+
+    if (++fConsecutiveOverruns >= HIPHOP_WASM_MAX_OVERRUNS) {
+        fOverrunSkipCount = HIPHOP_WASM_MAX_OVERRUNS;
     }
+
+    return false;
 }
-#endif // HIPHOP_SHARED_MEMORY_SIZE
+#endif
 
-WasmValueVector WasmPlugin::getTimePosition(WasmValueVector params)
+void WasmPlugin::writeSilence(float** outputs, uint32_t frames)
 {
-    (void)params;
-#if DISTRHO_PLUGIN_WANT_TIMEPOS
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
-
-        const TimePosition& pos = Plugin::getTimePosition();
-        fRuntime->setGlobal("_rw_int32_0", MakeI32(pos.playing));
-        fRuntime->setGlobal("_rw_int64_0", MakeI64(pos.frame));
+    for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
+        std::memset(outputs[i], 0, frames * sizeof(float));
+    }
+}
 
-        return {};
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
+void WasmPlugin::runBlock(const float** inputs, float** outputs, uint32_t frames, uint32_t frameOffset,
+                            const MidiEvent* midiEvents, uint32_t midiEventCount,
+                            uint32_t parameterEventCount)
+{
+    uint32_t midiBytes = 0;
+    midiEventCount = writeMidiInput(frames, frameOffset, midiEvents, midiEventCount, midiBytes);
+
+#if HIPHOP_SHARED_MEMORY_SIZE && HIPHOP_HOTSWAP_CROSSFADE_MS
+    if (fFadingInstance != nullptr) {
+        runCrossfade(inputs, outputs, frames, frameOffset, midiEventCount, midiBytes,
+                        parameterEventCount);
+        return;
+    }
+#endif
 
-        return {};
+#if HIPHOP_WASM_VOICE_WORKERS
+    if (! fVoiceShards.empty()) {
+        runVoiceShards(inputs, outputs, frames, frameOffset, midiBytes, parameterEventCount);
+        return;
     }
-#else
-    throw std::runtime_error("Called getTimePosition() without DISTRHO_PLUGIN_WANT_TIMEPOS");
-#endif // DISTRHO_PLUGIN_WANT_TIMEPOS
+#endif
+
+    runInstance(*fRuntime, fHandles, inputs, outputs, frames, frameOffset, midiEventCount,
+                midiBytes, parameterEventCount);
 }
 
-WasmValueVector WasmPlugin::writeMidiEvent(WasmValueVector params)
+uint32_t WasmPlugin::writeMidiInput(uint32_t frames, uint32_t frameOffset, const MidiEvent* midiEvents,
+                                    uint32_t midiEventCount, uint32_t& midiBytes)
 {
-    (void)params;
-#if DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
-    try {
-        CHECK_INSTANCE();
-        SCOPED_RUNTIME_LOCK();
+    // Called with fRuntimeLock held from run(). Events are serialized once into
+    // fMidiInput and then copied into every running instance. SysEx messages
+    // not fitting the block are queued in fMidiPending and streamed in chunks
+    // at frame 0 of the following blocks, only the first chunk starts with F0.
+    // Events that cannot be delivered at all are dropped and counted.
+
+    const uint32_t capacity = static_cast<uint32_t>(fMidiInput.size());
+    byte_t* const block = fMidiInput.data();
+    uint32_t size = 0;
+    uint32_t count = 0;
+
+    while ((fMidiPendingRead < fMidiPendingWrite) && (size + 8 < capacity)) {
+        uint32_t remaining;
+        std::memcpy(&remaining, fMidiPending.data() + fMidiPendingRead, 4);
+
+        const uint32_t chunk = std::min(remaining, capacity - size - 8);
+        writeMidiInputEvent(block + size, 0, fMidiPending.data() + fMidiPendingRead + 4, chunk);
+        size += 8 + chunk;
+        count++;
+
+        if (chunk == remaining) {
+            fMidiPendingRead += 4 + remaining;
+        } else {
+            remaining -= chunk;
+            fMidiPendingRead += chunk; // header moves over the bytes just sent
+            std::memcpy(fMidiPending.data() + fMidiPendingRead, &remaining, 4);
+        }
+    }
+
+    if (fMidiPendingRead == fMidiPendingWrite) {
+        fMidiPendingRead = 0;
+        fMidiPendingWrite = 0;
+    }
 
-        MidiEvent event;
-        byte_t* midiBlock = fRuntime->getMemory(fRuntime->getGlobal("_rw_midi_block"));
+    for (uint32_t i = 0; i < midiEventCount; i++) {
+        const MidiEvent& event = midiEvents[i];
+        const uint8_t* data = event.size > MidiEvent::kDataSize ? event.dataExt : event.data;
+        const bool sysex = (event.size > 0) && (data[0] == 0xF0);
+        const uint32_t frame = event.frame - frameOffset;
 
-        event.frame = *reinterpret_cast<uint32_t *>(midiBlock);
-        midiBlock += 4;
-        event.size = *reinterpret_cast<uint32_t *>(midiBlock);
-        midiBlock += 4;
+        if (sysex && (fMidiPendingWrite > 0)) {
+            if (! queuePendingSysex(data, event.size)) {
+                fMidiDroppedEventCount++;
+            }
+            continue; // keep order behind the SysEx being streamed
+        }
 
-        if (event.size > MidiEvent::kDataSize) {
-            event.dataExt = reinterpret_cast<uint8_t *>(midiBlock);
-        } else {
-            memcpy(event.data, midiBlock, event.size);
-            event.dataExt = 0;
+        if (size + 8 + event.size <= capacity) {
+            writeMidiInputEvent(block + size, frame < frames ? frame : frames - 1, data, event.size);
+            size += 8 + event.size;
+            count++;
+            continue;
         }
 
-        return { MakeI32(writeMidiEvent(event)) };
-    } catch (const std::exception& ex) {
-        d_stderr2(ex.what());
+        const uint32_t chunk = capacity > size + 8 ? capacity - size - 8 : 0;
+
+        if (! sysex || ! queuePendingSysex(data + chunk, event.size - chunk)) {
+            fMidiDroppedEventCount++;
+            continue;
+        }
 
-        return { MakeI32(0) };
+        if (chunk > 0) {
+            writeMidiInputEvent(block + size, frame < frames ? frame : frames - 1, data, chunk);
+            size += 8 + chunk;
+            count++;
+        }
     }
-#else
-    throw std::runtime_error("Called writeMidiEvent() without DISTRHO_PLUGIN_WANT_MIDI_OUTPUT");
-#endif // DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
+
+    midiBytes = size;
+
+    return count;
 }
 
-void WasmPlugin::onModuleLoad()
+void WasmPlugin::writeMidiInputEvent(byte_t* p, uint32_t frame, const uint8_t* data, uint32_t size)
+{
+    std::memcpy(p, &frame, 4);
+    std::memcpy(p + 4, &size, 4);
+    std::memcpy(p + 8, data, size);
+}
+
+uint32_t WasmPlugin::fitMidiInput(const byte_t* p, uint32_t size, uint32_t capacity,
+                                    uint32_t& eventCount)
 {
-    WasmFunctionMap hostFunc;
+    // Returns the number of bytes taken by the events that fit in capacity,
+    // eventCount is updated accordingly. Events are never split.
+
+    if (size <= capacity) {
+        return size;
+    }
 
-    hostFunc["get_samplerate"] = { {}, { WASM_F32 }, [this](WasmValueVector) -> WasmValueVector {
-        return { MakeF32(getSampleRate()) };
-    }};
+    uint32_t fitSize = 0;
+    uint32_t fitCount = 0;
 
-    hostFunc["get_time_position"] = { {}, {}, 
-        std::bind(&WasmPlugin::getTimePosition, this, std::placeholders::_1)
-    };
+    while (fitSize + 8 <= capacity) {
+        uint32_t eventSize;
+        std::memcpy(&eventSize, p + fitSize + 4, 4);
 
-    hostFunc["write_midi_event"] = { {}, { WASM_I32 }, 
-        std::bind(&WasmPlugin::writeMidiEvent, this, std::placeholders::_1)
-    };
+        if (fitSize + 8 + eventSize > capacity) {
+            break;
+        }
+
+        fitSize += 8 + eventSize;
+        fitCount++;
+    }
+
+    eventCount = fitCount;
 
-    fRuntime->createInstance(hostFunc);
+    return fitSize;
+}
+
+bool WasmPlugin::queuePendingSysex(const uint8_t* data, uint32_t size)
+{
+    if (fMidiPendingWrite + 4 + size > fMidiPending.size()) {
+        return false;
+    }
 
-    fRuntime->setGlobal("_rw_num_inputs", MakeI32(DISTRHO_PLUGIN_NUM_INPUTS));
-    fRuntime->setGlobal("_rw_num_outputs", MakeI32(DISTRHO_PLUGIN_NUM_OUTPUTS));
+    std::memcpy(fMidiPending.data() + fMidiPendingWrite, &size, 4);
+    std::memcpy(fMidiPending.data() + fMidiPendingWrite + 4, data, size);
+    fMidiPendingWrite += 4 + size;
+
+    return true;
+}
+
+void WasmPlugin::applyParameterChanges()
+{
+    // Called with fRuntimeLock held, which makes the lock holder the single
+    // consumer of the changed bits
+
+    takeParameterChanges(fParameterCount, [this](uint32_t index, float value) {
+        setInstanceParameterValue(index, value);
+    });
+}
+
+void WasmPlugin::markAllParametersChanged()
+{
+    for (uint32_t i = 0; i < fParameterChangedWords; i++) {
+        fParameterChangedBits[i].store(~0u, std::memory_order_release);
+    }
+
+    fParameterChanged.store(true, std::memory_order_release);
+}
+
+template<class F>
+uint32_t WasmPlugin::takeParameterChanges(uint32_t maxCount, F callback)
+{
+    // Calls back with the current value of up to maxCount parameters written
+    // since the last call, the others are left for the next one
+
+    if (! fParameterChanged.exchange(false, std::memory_order_acq_rel)) {
+        return 0;
+    }
+
+    uint32_t count = 0;
+
+    for (uint32_t i = 0; i < fParameterChangedWords; i++) {
+        uint32_t bits = fParameterChangedBits[i].exchange(0, std::memory_order_acquire);
+
+        for (uint32_t j = 0; (j < 32) && (bits != 0); j++) {
+            const uint32_t mask = 1u << j;
+
+            if ((bits & mask) == 0) {
+                continue;
+            }
+
+            if (count == maxCount) {
+                fParameterChangedBits[i].fetch_or(bits, std::memory_order_relaxed);
+                fParameterChanged.store(true, std::memory_order_release);
+
+                return count;
+            }
+
+            bits &= ~mask;
+
+            const uint32_t index = i * 32 + j;
+
+            if (index < fParameterCount) {
+                callback(index, fParameterValues[index].load(std::memory_order_relaxed));
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+void WasmPlugin::setInstanceParameterValue(uint32_t index, float value)
+{
+    fRuntime->call(fHandles.setParameterValue, index, value);
+
+#if HIPHOP_WASM_VOICE_WORKERS
+    for (size_t i = 1; i < fVoiceShards.size(); i++) {
+        fVoiceShards[i].runtime->call(fVoiceShards[i].handles.setParameterValue, index, value);
+    }
+#endif
+}
+
+uint32_t WasmPlugin::writeParameterEvents()
+{
+    // Called with fRuntimeLock held from run(). Changes are handed to the
+    // module as a single event list instead of one call per change. DPF does
+    // not provide frame offsets for parameter changes, so all events are
+    // placed at frame 0. Changes not fitting the block go with the next one.
+
+    if (! fParameterChanged.load(std::memory_order_acquire)) {
+        return 0;
+    }
+
+    byte_t* parameterBlock = fRuntime->getMemory(fRuntime->getGlobal(fHandles.parameterBlock));
+
+    return takeParameterChanges(MAX_PARAMETER_EVENTS, [&parameterBlock](uint32_t index, float value) {
+        *reinterpret_cast<uint32_t *>(parameterBlock) = 0;
+        parameterBlock += 4;
+        *reinterpret_cast<uint32_t *>(parameterBlock) = index;
+        parameterBlock += 4;
+        *reinterpret_cast<float32_t *>(parameterBlock) = value;
+        parameterBlock += 4;
+    });
+}
+
+void WasmPlugin::updateOutputParameters()
+{
+    for (std::vector<uint32_t>::const_iterator it = fOutputParameters.cbegin(); it != fOutputParameters.cend(); ++it) {
+        fParameterValues[*it].store(fRuntime->call<float>(fHandles.getParameterValue, *it),
+                                    std::memory_order_relaxed);
+    }
+}
+
+void WasmPlugin::refreshParameterValues()
+{
+    for (uint32_t i = 0; i < fParameterCount; i++) {
+        fParameterValues[i].store(fRuntime->call<float>(fHandles.getParameterValue, i),
+                                  std::memory_order_relaxed);
+    }
+}
+
+void WasmPlugin::runInstance(WasmRuntime& runtime, const Handles& handles, const float** inputs,
+                                float** outputs, uint32_t frames, uint32_t frameOffset,
+                                uint32_t midiEventCount, uint32_t midiBytes,
+                                uint32_t parameterEventCount)
+{
+    writeInstanceInput(runtime, handles, inputs, frames, frameOffset);
+
+    if (midiBytes > 0) {
+        // A hot-swapped module might have allocated a smaller block
+        const uint32_t midiInputEventCount = midiEventCount;
+        midiBytes = fitMidiInput(fMidiInput.data(), midiBytes, handles.midiBlockBytes, midiEventCount);
+
+        if (midiEventCount < midiInputEventCount) {
+            fMidiDroppedEventCount += midiInputEventCount - midiEventCount;
+        }
+
+        memcpy(runtime.getMemory(runtime.getGlobal(handles.midiBlock)), fMidiInput.data(), midiBytes);
+    }
+
+    const uint32_t memoryGrowCount = runtime.getMemoryGrowCount();
+
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+    // Shared by run() and collect(), made unlimited again afterwards so calls
+    // from other entry points are never metered
+    runtime.setFuel(static_cast<uint64_t>(HIPHOP_WASM_FUEL_PER_FRAME) * frames);
+#endif
+
+    runtime.call(handles.run, frames, midiEventCount, parameterEventCount);
+
+    if (runtime.getMemoryGrowCount() != memoryGrowCount) {
+        fMemoryGrowBlockCount++; // memory base already refreshed by call()
+    }
+
+#if defined(HIPHOP_WASM_COLLECT_PER_BLOCK) && defined(HIPHOP_WASM_GC_STATS)
+    const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    runtime.call(handles.collect);
+    const uint64_t gcTimeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - t0).count();
+
+    fGcBlockCount++;
+    fGcTimeNs += gcTimeNs;
+
+    if (gcTimeNs > fGcMaxTimeNs) {
+        fGcMaxTimeNs = gcTimeNs; // single writer
+    }
+#elif defined(HIPHOP_WASM_COLLECT_PER_BLOCK)
+    runtime.call(handles.collect);
+#endif
+
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+    runtime.setFuel(WASM_FUEL_UNLIMITED);
+#endif
+
+    const float32_t* audioBlock = reinterpret_cast<float32_t *>(runtime.getMemory(
+        runtime.getGlobal(handles.outputBlock)));
+
+    for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
+        memcpy(outputs[i], audioBlock + i * BLOCK_FRAMES, frames * 4);
+    }
+}
+
+void WasmPlugin::writeInstanceInput(WasmRuntime& runtime, const Handles& handles, const float** inputs,
+                                    uint32_t frames, uint32_t frameOffset)
+{
+    float32_t* audioBlock = reinterpret_cast<float32_t *>(runtime.getMemory(
+        runtime.getGlobal(handles.inputBlock)));
+
+    for (int i = 0; i < DISTRHO_PLUGIN_NUM_INPUTS; i++) {
+        memcpy(audioBlock + i * BLOCK_FRAMES, inputs[i], frames * 4);
+    }
+
+#if DISTRHO_PLUGIN_WANT_TIMEPOS
+    writeTimePosition(runtime.getMemory(runtime.getGlobal(handles.timeBlock)), frameOffset);
+#else
+    (void)frameOffset;
+#endif
+}
+
+#if DISTRHO_PLUGIN_WANT_TIMEPOS
+template<typename T>
+static void writeTimePositionField(byte_t* timeBlock, uint32_t offset, T value)
+{
+    std::memcpy(timeBlock + offset, &value, sizeof(value));
+}
+
+void WasmPlugin::writeTimePosition(byte_t* timeBlock, uint32_t frameOffset)
+{
+    // Layout is documented next to _rw_time_block in index.ts. Host values
+    // are for the start of the host buffer, the frame and BBT position are
+    // advanced to the start of each sub-block. Tempo is assumed constant
+    // within the host buffer.
+
+    const TimePosition& pos = getTimePosition();
+    int32_t bar = pos.bbt.bar;
+    int32_t beat = pos.bbt.beat;
+    double tick = pos.bbt.tick;
+    double barStartTick = pos.bbt.barStartTick;
+    const int32_t beatsPerBar = static_cast<int32_t>(pos.bbt.beatsPerBar);
+
+    if (pos.playing && pos.bbt.valid && (frameOffset > 0) && (beatsPerBar > 0)
+            && (pos.bbt.ticksPerBeat > 0)) {
+        tick += frameOffset * pos.bbt.beatsPerMinute / 60.0 / getSampleRate() * pos.bbt.ticksPerBeat;
+
+        const int32_t beats = static_cast<int32_t>(tick / pos.bbt.ticksPerBeat);
+        tick -= beats * pos.bbt.ticksPerBeat;
+
+        const int32_t beatIndex = beat - 1 + beats; // beats and bars are 1-based
+        const int32_t bars = beatIndex / beatsPerBar;
+        beat = beatIndex % beatsPerBar + 1;
+        bar += bars;
+        barStartTick += static_cast<double>(bars) * beatsPerBar * pos.bbt.ticksPerBeat;
+    }
+
+    writeTimePositionField<uint32_t>(timeBlock, 0, pos.playing);
+    writeTimePositionField<uint32_t>(timeBlock, 4, pos.bbt.valid);
+    writeTimePositionField<uint64_t>(timeBlock, 8, pos.frame + frameOffset);
+    writeTimePositionField<int32_t>(timeBlock, 16, bar);
+    writeTimePositionField<int32_t>(timeBlock, 20, beat);
+    writeTimePositionField<double>(timeBlock, 24, tick);
+    writeTimePositionField<double>(timeBlock, 32, barStartTick);
+    writeTimePositionField<float>(timeBlock, 40, pos.bbt.beatsPerBar);
+    writeTimePositionField<float>(timeBlock, 44, pos.bbt.beatType);
+    writeTimePositionField<double>(timeBlock, 48, pos.bbt.ticksPerBeat);
+    writeTimePositionField<double>(timeBlock, 56, pos.bbt.beatsPerMinute);
+}
+#endif // DISTRHO_PLUGIN_WANT_TIMEPOS
+
+#if DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
+void WasmPlugin::writeMidiOutput(uint32_t frames, uint32_t frameOffset)
+{
+    // Called with fRuntimeLock held from run(). Events written by the module
+    // during the last block are sent to the host in a single pass. During a
+    // crossfade only the events from the new instance are sent. Frames are
+    // clamped to the block, events are never sent out of order.
+
+    const uint32_t size = std::min<uint32_t>(fRuntime->getGlobal(fHandles.midiOutBytes).of.i32,
+                                             MAX_MIDI_OUTPUT_BYTES);
+    const byte_t* midiBlock = fRuntime->getMemory(fRuntime->getGlobal(fHandles.midiOutBlock));
+    const byte_t* end = midiBlock + size;
+    uint32_t droppedCount = fRuntime->getGlobal(fHandles.midiOutDropped).of.i32;
+    bool hostFull = false;
+    MidiEvent event;
+
+    while (midiBlock + 8 <= end) {
+        const uint32_t frame = *reinterpret_cast<const uint32_t *>(midiBlock);
+        midiBlock += 4;
+        event.frame = frameOffset + (frame < frames ? frame : frames - 1);
+        event.size = *reinterpret_cast<const uint32_t *>(midiBlock);
+        midiBlock += 4;
+
+        if (midiBlock + event.size > end) {
+            droppedCount++;
+            break;
+        }
+
+        if (event.size > MidiEvent::kDataSize) {
+            event.dataExt = reinterpret_cast<const uint8_t *>(midiBlock);
+        } else {
+            memcpy(event.data, midiBlock, event.size);
+            event.dataExt = 0;
+        }
+
+        midiBlock += event.size;
+
+        // Once the host buffer is full the remaining events are only counted
+        if (hostFull || ! writeMidiEvent(event)) {
+            hostFull = true;
+            droppedCount++;
+        }
+    }
+
+    if (droppedCount > 0) {
+        fMidiOutputDroppedEventCount += droppedCount;
+    }
+}
+#endif // DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
+
+#if HIPHOP_WASM_VOICE_WORKERS
+void WasmPlugin::createVoiceShards()
+{
+    if (fRuntime->callFunctionReturnSingleValue("get_voice_sharding").of.i32 == 0) {
+        return;
+    }
+
+    uint32_t workerCount = HIPHOP_WASM_VOICE_WORKERS;
+    uint32_t shardCount = HIPHOP_WASM_VOICE_SHARDS;
+
+    // Runtime override of the worker count, allows measuring scaling without
+    // rebuilding. Shards are raised to at least one per worker, 0 disables
+    // voice sharding.
+    if (const char* s = std::getenv("HIPHOP_WASM_VOICE_WORKERS")) {
+        char* end;
+        const unsigned long value = std::strtoul(s, &end, 10);
+
+        if ((end != s) && (value == 0)) {
+            return;
+        }
+
+        if ((value > 0) && (value <= 255)) {
+            workerCount = static_cast<uint32_t>(value);
+            shardCount = std::max(shardCount, workerCount);
+        }
+    }
+
+    fVoiceShards.resize(shardCount);
+    fVoiceShards[0].runtime = fRuntime;
+    fVoiceShards[0].handles = fHandles;
+
+    for (size_t i = 1; i < fVoiceShards.size(); i++) {
+        VoiceShard& shard = fVoiceShards[i];
+        shard.runtime.reset(new WasmRuntime());
+        shard.runtime->load(*fRuntime);
+        createInstance(*shard.runtime, shard.handles);
+
+        // Same initialization sequence the first instance went through
+        shard.runtime->callFunction("get_descriptors", { MakeI32(fParameterCount),
+                                    MakeI32(fProgramCount), MakeI32(fStateCount) });
+    }
+
+    resetVoiceRouting();
+    fVoicePool.reset(new WorkerPool(workerCount, HIPHOP_WASM_VOICE_SPIN_US,
+                                    WasmPlugin::runVoiceShard, this));
+}
+
+void WasmPlugin::runVoiceShards(const float** inputs, float** outputs, uint32_t frames,
+                                uint32_t frameOffset, uint32_t midiBytes, uint32_t parameterEventCount)
+{
+    // Called with fRuntimeLock held from runBlock(). Every shard gets the same
+    // audio input, time position and parameter events, parameter events were
+    // written to the first one by writeParameterEvents(). Only the calls into
+    // the modules run in parallel, outputs are mixed here afterwards.
+
+    const byte_t* parameterBlock = fRuntime->getMemory(fRuntime->getGlobal(fHandles.parameterBlock));
+
+    for (size_t i = 0; i < fVoiceShards.size(); i++) {
+        VoiceShard& shard = fVoiceShards[i];
+        WasmRuntime& runtime = *shard.runtime;
+
+        writeInstanceInput(runtime, shard.handles, inputs, frames, frameOffset);
+
+        if ((i > 0) && (parameterEventCount > 0)) {
+            // Frame, index and value
+            memcpy(runtime.getMemory(runtime.getGlobal(shard.handles.parameterBlock)), parameterBlock,
+                    12 * parameterEventCount);
+        }
+
+        shard.midiBlock = runtime.getMemory(runtime.getGlobal(shard.handles.midiBlock));
+        shard.midiBytes = 0;
+        shard.midiEventCount = 0;
+        shard.memoryGrowCount = runtime.getMemoryGrowCount();
+        shard.faulted = false;
+    }
+
+    routeMidiInput(midiBytes);
+
+    fVoiceFrames = frames;
+    fVoiceParameterEventCount = parameterEventCount;
+    fVoicePool->run(static_cast<uint32_t>(fVoiceShards.size()));
+
+    bool faulted = false;
+    bool memoryGrew = false;
+
+    for (size_t i = 0; i < fVoiceShards.size(); i++) {
+        VoiceShard& shard = fVoiceShards[i];
+        WasmRuntime& runtime = *shard.runtime;
+
+        if (shard.faulted) {
+            onRunFault(runtime);
+            faulted = true;
+            continue;
+        }
+
+        memoryGrew = memoryGrew || (runtime.getMemoryGrowCount() != shard.memoryGrowCount);
+
+        const float32_t* audioBlock = reinterpret_cast<float32_t *>(runtime.getMemory(
+            runtime.getGlobal(shard.handles.outputBlock)));
+
+        for (int j = 0; j < DISTRHO_PLUGIN_NUM_OUTPUTS; j++) {
+            const float32_t* block = audioBlock + j * BLOCK_FRAMES;
+
+            if (i == 0) {
+                memcpy(outputs[j], block, frames * 4);
+            } else {
+                for (uint32_t k = 0; k < frames; k++) {
+                    outputs[j][k] += block[k];
+                }
+            }
+        }
+    }
+
+    if (memoryGrew) {
+        fMemoryGrowBlockCount++;
+    }
+
+    if (faulted) {
+        SUSPEND_ALLOCATION_GUARD();
+        throw wasm_runtime_exception("Voice shard failed");
+    }
+}
+
+void WasmPlugin::runVoiceShard(void* context, uint32_t index)
+{
+    // Called from the worker pool, possibly on a worker thread. Only touches
+    // the instance of the given shard, faults are reported back to run().
+
+    WasmPlugin* plugin = static_cast<WasmPlugin*>(context);
+    VoiceShard& shard = plugin->fVoiceShards[index];
+    WasmRuntime& runtime = *shard.runtime;
+
+    try {
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+        runtime.setFuel(static_cast<uint64_t>(HIPHOP_WASM_FUEL_PER_FRAME) * plugin->fVoiceFrames);
+#endif
+        runtime.call(shard.handles.run, plugin->fVoiceFrames, shard.midiEventCount,
+                        plugin->fVoiceParameterEventCount);
+#if defined(HIPHOP_WASM_COLLECT_PER_BLOCK)
+        runtime.call(shard.handles.collect);
+#endif
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+        runtime.setFuel(WASM_FUEL_UNLIMITED);
+#endif
+    } catch (const std::exception&) {
+        shard.faulted = true;
+    }
+}
+
+void WasmPlugin::routeMidiInput(uint32_t midiBytes)
+{
+    // Splits the events serialized by writeMidiInput() among the shards MIDI
+    // blocks. Blocks are normally as large as fMidiInput, events not fitting
+    // the block a shard allocated are dropped for that shard.
+
+    const byte_t* p = fMidiInput.data();
+    const byte_t* end = p + midiBytes;
+
+    while (p + 8 <= end) {
+        uint32_t size;
+        std::memcpy(&size, p + 4, 4);
+
+        const uint32_t eventBytes = 8 + size;
+        const int target = routeMidiEvent(reinterpret_cast<const uint8_t *>(p + 8), size);
+
+        for (size_t i = 0; i < fVoiceShards.size(); i++) {
+            if ((target < 0) || (static_cast<size_t>(target) == i)) {
+                VoiceShard& shard = fVoiceShards[i];
+
+                if (shard.midiBytes + eventBytes > shard.handles.midiBlockBytes) {
+                    fMidiDroppedEventCount++;
+                    continue;
+                }
+
+                memcpy(shard.midiBlock + shard.midiBytes, p, eventBytes);
+                shard.midiBytes += eventBytes;
+                shard.midiEventCount++;
+            }
+        }
+
+        p += eventBytes;
+    }
+}
+
+int WasmPlugin::routeMidiEvent(const uint8_t* data, uint32_t size)
+{
+    // Returns the shard for an event or -1 for all of them. A note on goes to
+    // the shard holding fewer notes, starting after the last one picked so
+    // ties are spread. Note off and polyphonic aftertouch follow the note on.
+    // Anything else, including SysEx continuation chunks, goes to all shards.
+
+    if (size < 3) {
+        return -1;
+    }
+
+    const uint8_t status = data[0] & 0xF0;
+    const uint8_t channel = data[0] & 0x0F;
+
+    if ((status == 0xB0) && ((data[1] == 120) || (data[1] == 123))) {
+        // All sound off and all notes off release every note of the channel
+        for (uint32_t note = 0; note < 128; note++) {
+            uint8_t& owner = fVoiceNoteShard[channel * 128 + note];
+
+            if (owner > 0) {
+                fVoiceShards[owner - 1].activeNotes--;
+                owner = 0;
+            }
+        }
+
+        return -1;
+    }
+
+    if ((status != 0x80) && (status != 0x90) && (status != 0xA0)) {
+        return -1;
+    }
+
+    uint8_t& owner = fVoiceNoteShard[channel * 128 + (data[1] & 0x7F)];
+
+    if ((status == 0x90) && (data[2] > 0)) {
+        if (owner == 0) {
+            const uint32_t count = static_cast<uint32_t>(fVoiceShards.size());
+            uint32_t best = fVoiceNextShard % count;
+
+            for (uint32_t i = 1; i < count; i++) {
+                const uint32_t candidate = (fVoiceNextShard + i) % count;
+
+                if (fVoiceShards[candidate].activeNotes < fVoiceShards[best].activeNotes) {
+                    best = candidate;
+                }
+            }
+
+            owner = static_cast<uint8_t>(best + 1);
+            fVoiceShards[best].activeNotes++;
+            fVoiceNextShard = best + 1;
+        }
+
+        return owner - 1; // retriggered notes stay in their shard
+    }
+
+    if (owner == 0) {
+        return -1; // note started before activate, let every shard see it
+    }
+
+    const int shard = owner - 1;
+
+    if (status != 0xA0) {
+        fVoiceShards[shard].activeNotes--;
+        owner = 0;
+    }
+
+    return shard;
+}
+
+void WasmPlugin::resetVoiceRouting()
+{
+    std::memset(fVoiceNoteShard, 0, sizeof(fVoiceNoteShard));
+    fVoiceNextShard = 0;
+
+    for (size_t i = 0; i < fVoiceShards.size(); i++) {
+        fVoiceShards[i].activeNotes = 0;
+    }
+}
+#endif // HIPHOP_WASM_VOICE_WORKERS
+
+#if HIPHOP_SHARED_MEMORY_SIZE
+void WasmPlugin::sharedMemoryChanged(const unsigned char* data, size_t size, uint32_t hints)
+{
+    if (hints & (kShMemHintInternal | kShMemHintWasmBinary)) {
+        try {
+            loadWasmBinary(data, size);
+        } catch (const std::exception& ex) {
+            d_stderr2(ex.what());
+        }
+    }
+}
+
+void WasmPlugin::loadWasmBinary(const unsigned char* data, size_t size)
+{
+#if HIPHOP_WASM_VOICE_WORKERS
+    if (! fVoiceShards.empty()) {
+        throw std::runtime_error("Hot-swap is not available for plugins using voice sharding");
+    }
+#endif
+
+    if (size > HIPHOP_SHARED_MEMORY_SIZE) {
+        throw std::runtime_error("Wasm binary does not fit in shared memory");
+    }
+
+    // Called from setState() on a non real-time thread. The binary is copied
+    // here because the UI can rewrite the shared memory region at any time.
+    // Calls must not overlap, hosts never call setState() concurrently.
+    // Buffer and thread are a one time cost paid by the first hot-swap, the
+    // buffer is allocated before the thread that reads it is started.
+    if (fPendingBinary == nullptr) {
+        fPendingBinary.reset(new unsigned char[HIPHOP_SHARED_MEMORY_SIZE]);
+    }
+
+    const uint32_t sequence = fPendingBinarySequence.load(std::memory_order_relaxed);
+    fPendingBinarySequence.store(sequence + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(fPendingBinary.get(), data, size);
+    fPendingBinarySize.store(size, std::memory_order_relaxed);
+    fPendingBinarySequence.store(sequence + 2, std::memory_order_release);
+
+    if (! fLoaderStarted.exchange(true)) {
+        fLoaderThread.startThread();
+    }
+
+    fLoaderThread.wakeUp();
+}
+
+void WasmPlugin::loaderThreadRun()
+{
+    std::vector<unsigned char> binary;
+
+    if (takePendingBinary(binary)) {
+        loadPendingBinary(binary);
+    }
+
+    updatePendingActivation();
+
+    // The audio thread adopts the instance at the start of the next block and
+    // hands back the replaced one, after the crossfade when enabled. When the
+    // plugin is not running adopt here instead, fActive is re-checked by
+    // adoptPendingInstance() while holding the lock.
+    if (! fActive) {
+        SCOPED_RUNTIME_LOCK();
+        adoptPendingInstance();
+#if HIPHOP_HOTSWAP_CROSSFADE_MS
+        finishCrossfade();
+#endif
+    }
+
+    collectRetiredInstance();
+}
+
+bool WasmPlugin::takePendingBinary(std::vector<unsigned char>& binary)
+{
+    while (true) {
+        const uint32_t sequence = fPendingBinarySequence.load(std::memory_order_acquire);
+
+        if ((sequence == fLoadedBinarySequence) || ((sequence & 1) != 0)) {
+            return false; // nothing new, or a writer is about to wake us again
+        }
+
+        const unsigned char* data = fPendingBinary.get();
+        const size_t size = fPendingBinarySize.load(std::memory_order_relaxed);
+
+        binary.assign(data, data + size);
+        std::atomic_thread_fence(std::memory_order_acquire);
+
+        if (fPendingBinarySequence.load(std::memory_order_relaxed) == sequence) {
+            fLoadedBinarySequence = sequence;
+            return ! binary.empty();
+        }
+    }
+}
+
+void WasmPlugin::loadPendingBinary(const std::vector<unsigned char>& binary)
+{
+    Instance* instance = new Instance();
+    instance->active = false;
+
+    try {
+        instance->runtime.reset(new WasmRuntime());
+        instance->runtime->load(binary.data(), binary.size());
+        createInstance(*instance->runtime, instance->handles);
+
+        // This has no effect on the host parameters but might be needed by the
+        // plugin code to properly initialize. A single call visits all indices.
+        instance->runtime->callFunction("get_descriptors", { MakeI32(fParameterCount),
+                                        MakeI32(fProgramCount), MakeI32(fStateCount) });
+
+        // Plugin activation might change before the instance is adopted, this
+        // is fixed by updatePendingActivation()
+        if (fActive) {
+            instance->runtime->callFunction("activate");
+            instance->active = true;
+        }
+    } catch (const std::exception& ex) {
+        d_stderr2(ex.what());
+        delete instance;
+
+        return;
+    }
+
+    // A previous instance that was never adopted is simply discarded. Only this
+    // thread publishes, the audio thread puts back instances it cannot adopt
+    // only while the slot is still empty.
+    delete fPendingInstance.exchange(instance, std::memory_order_acq_rel);
+}
+
+void WasmPlugin::updatePendingActivation()
+{
+    Instance* instance = fPendingInstance.exchange(nullptr, std::memory_order_acq_rel);
+
+    if (instance == nullptr) {
+        return;
+    }
+
+    const bool active = fActive;
+
+    if (instance->active != active) {
+        try {
+            instance->runtime->callFunction(active ? "activate" : "deactivate");
+            instance->active = active;
+        } catch (const std::exception& ex) {
+            d_stderr2(ex.what());
+            delete instance;
+
+            return;
+        }
+    }
+
+    Instance* expected = nullptr;
+
+    if (! fPendingInstance.compare_exchange_strong(expected, instance, std::memory_order_acq_rel)) {
+        delete instance; // cannot happen, only this thread publishes
+    }
+}
+
+void WasmPlugin::adoptPendingInstance()
+{
+    // Called with fRuntimeLock held, activate() and deactivate() also hold it
+    // so fActive is stable here. Swapping the shared pointers neither allocates
+    // nor frees memory.
+
+    if (fRetiredInstance.load(std::memory_order_acquire) != nullptr) {
+        return; // loader thread did not collect the previous runtime yet
+    }
+
+#if HIPHOP_HOTSWAP_CROSSFADE_MS
+    if (fFadingInstance != nullptr) {
+        return; // previous crossfade still running
+    }
+#endif
+
+    Instance* instance = fPendingInstance.exchange(nullptr, std::memory_order_acq_rel);
+
+    if (instance == nullptr) {
+        return;
+    }
+
+    if (instance->active != fActive) {
+        // Plugin was activated or deactivated while the instance was being
+        // created. Give it back to the loader thread for updating, unless a
+        // newer instance was published meanwhile. Then it is retired.
+        Instance* expected = nullptr;
+
+        if (! fPendingInstance.compare_exchange_strong(expected, instance, std::memory_order_acq_rel)) {
+            fRetiredInstance.store(instance, std::memory_order_release);
+        }
+
+        fLoaderThread.wakeUp();
+
+        return;
+    }
+
+    std::swap(fRuntime, instance->runtime);
+    std::swap(fHandles, instance->handles);
+
+    // New instance starts with default values, hand it the current ones
+    markAllParametersChanged();
+
+    // Faults belong to the replaced instance
+    fFaulted = false;
+    fConsecutiveOverruns = 0;
+    fOverrunSkipCount = 0;
+
+#if HIPHOP_HOTSWAP_CROSSFADE_MS
+    const bool canFade = fActive && ! fFadeBuffer.empty()
+                            && (instance->runtime != nullptr) && instance->runtime->hasInstance();
+
+    if (canFade) {
+        fFadingInstance = instance;
+        fFadePosition = 0;
+        fFadeLength = static_cast<uint32_t>(HIPHOP_HOTSWAP_CROSSFADE_MS * getSampleRate() / 1000.0);
+        fFadeLength = fFadeLength > 0 ? fFadeLength : 1;
+
+        return;
+    }
+#endif
+
+    fRetiredInstance.store(instance, std::memory_order_release);
+    fLoaderThread.wakeUp();
+}
+
+void WasmPlugin::collectRetiredInstance()
+{
+    delete fRetiredInstance.exchange(nullptr, std::memory_order_acq_rel);
+}
+
+#if HIPHOP_HOTSWAP_CROSSFADE_MS
+void WasmPlugin::runCrossfade(const float** inputs, float** outputs, uint32_t frames,
+                                uint32_t frameOffset, uint32_t midiEventCount, uint32_t midiBytes,
+                                uint32_t parameterEventCount)
+{
+    if (frames * DISTRHO_PLUGIN_NUM_OUTPUTS > fFadeBuffer.size()) {
+        finishCrossfade(); // host exceeded the announced buffer size
+        runInstance(*fRuntime, fHandles, inputs, outputs, frames, frameOffset, midiEventCount,
+                    midiBytes, parameterEventCount);
+
+        return;
+    }
+
+    float* fadeOutputs[DISTRHO_PLUGIN_NUM_OUTPUTS];
+
+    for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
+        fadeOutputs[i] = fFadeBuffer.data() + i * frames;
+    }
+
+    // Run the replaced instance first, hosts can pass the same buffers for
+    // inputs and outputs
+    const std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    bool fadingOk = true;
+
+    try {
+        runInstance(*fFadingInstance->runtime, fFadingInstance->handles, inputs, fadeOutputs,
+                    frames, frameOffset, midiEventCount, midiBytes, 0);
+    } catch (const std::exception&) {
+        fadingOk = false;
+    }
+
+    fFadeTimeNs += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - t0).count();
+    fFadeBlockCount++;
+
+    runInstance(*fRuntime, fHandles, inputs, outputs, frames, frameOffset, midiEventCount,
+                midiBytes, parameterEventCount);
+
+    if (! fadingOk) {
+        finishCrossfade();
+        return;
+    }
+
+    // Linear ramp, consecutive versions of the same DSP code usually produce
+    // correlated signals
+    const float length = static_cast<float>(fFadeLength);
+
+    for (int i = 0; i < DISTRHO_PLUGIN_NUM_OUTPUTS; i++) {
+        uint32_t position = fFadePosition;
+
+        for (uint32_t j = 0; j < frames; j++, position++) {
+            const float gain = position < fFadeLength ? position / length : 1.f;
+            outputs[i][j] = fadeOutputs[i][j] + gain * (outputs[i][j] - fadeOutputs[i][j]);
+        }
+    }
+
+    fFadePosition += frames;
+
+    if (fFadePosition >= fFadeLength) {
+        finishCrossfade();
+    }
+}
+
+void WasmPlugin::finishCrossfade()
+{
+    if (fFadingInstance == nullptr) {
+        return;
+    }
+
+    // Retired slot is known to be empty, adoption waits for it
+    fRetiredInstance.store(fFadingInstance, std::memory_order_release);
+    fFadingInstance = nullptr;
+    fLoaderThread.wakeUp();
+}
+#endif // HIPHOP_HOTSWAP_CROSSFADE_MS
+#endif // HIPHOP_SHARED_MEMORY_SIZE
+
+void WasmPlugin::onModuleLoad()
+{
+    createInstance(*fRuntime, fHandles);
+    loadMetadata();
+    loadDescriptors();
+#if HIPHOP_WASM_VOICE_WORKERS
+    createVoiceShards();
+#endif
+}
+
+void WasmPlugin::loadMetadata()
+{
+    fLabel    = fRuntime->callFunctionReturnCString("get_label");
+    fMaker    = fRuntime->callFunctionReturnCString("get_maker");
+    fLicense  = fRuntime->callFunctionReturnCString("get_license");
+    fVersion  = fRuntime->callFunctionReturnSingleValue("get_version").of.i32;
+    fUniqueId = fRuntime->callFunctionReturnSingleValue("get_unique_id").of.i64;
+}
+
+// Table contents come from the module and are not trusted, every read is
+// checked against the table end, which is checked against the memory size
+
+static uint32_t readDescriptorUInt32(const byte_t*& p, const byte_t* end)
+{
+    if (end - p < static_cast<ptrdiff_t>(sizeof(uint32_t))) {
+        throw wasm_module_exception("Invalid descriptor table size");
+    }
+
+    uint32_t value;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+
+    return value;
+}
+
+static float readDescriptorFloat32(const byte_t*& p, const byte_t* end)
+{
+    if (end - p < static_cast<ptrdiff_t>(sizeof(float))) {
+        throw wasm_module_exception("Invalid descriptor table size");
+    }
+
+    float value;
+    std::memcpy(&value, p, sizeof(value));
+    p += sizeof(value);
+
+    return value;
+}
+
+static String readDescriptorString(const byte_t*& p, const byte_t* end)
+{
+    const uint32_t size = readDescriptorUInt32(p, end);
+
+    if (static_cast<size_t>(end - p) < size) {
+        throw wasm_module_exception("Invalid descriptor table string");
+    }
+
+    const std::string s (p, size);
+    p += size;
+
+    return String(s.c_str());
+}
+
+void WasmPlugin::loadDescriptors()
+{
+    // Layout is documented next to get_descriptors() in index.ts
+    const WasmValue wPtr = fRuntime->callFunctionReturnSingleValue("get_descriptors",
+        { MakeI32(fParameterCount), MakeI32(fProgramCount), MakeI32(fStateCount) });
+
+    const uint64_t offset = static_cast<uint32_t>(wPtr.of.i32);
+    const uint64_t memorySize = static_cast<uint64_t>(fRuntime->getMemoryPages()) * 65536;
+
+    if (offset + 16 > memorySize) {
+        throw wasm_module_exception("Invalid descriptor table address");
+    }
+
+    const byte_t* start = fRuntime->getMemory(wPtr);
+    const byte_t* p = start;
+    const uint32_t size = readDescriptorUInt32(p, start + 4);
+
+    if ((size < 16) || (offset + size > memorySize)) {
+        throw wasm_module_exception("Invalid descriptor table size");
+    }
+
+    const byte_t* end = start + size;
+
+    if ((readDescriptorUInt32(p, end) != fParameterCount) || (readDescriptorUInt32(p, end) != fProgramCount)
+            || (readDescriptorUInt32(p, end) != fStateCount)) {
+        throw wasm_module_exception("Invalid descriptor table header");
+    }
+
+    fParameterDescriptors.resize(fParameterCount);
+
+    for (uint32_t i = 0; i < fParameterCount; i++) {
+        ParameterDescriptor& descriptor = fParameterDescriptors[i];
+        descriptor.hints = readDescriptorUInt32(p, end);
+        descriptor.def   = readDescriptorFloat32(p, end);
+        descriptor.min   = readDescriptorFloat32(p, end);
+        descriptor.max   = readDescriptorFloat32(p, end);
+        descriptor.name  = readDescriptorString(p, end);
+    }
+
+    fProgramNames.resize(fProgramCount);
+
+    for (uint32_t i = 0; i < fProgramCount; i++) {
+        fProgramNames[i] = readDescriptorString(p, end);
+    }
+
+    fStateDescriptors.resize(fStateCount);
+
+    for (uint32_t i = 0; i < fStateCount; i++) {
+        StateDescriptor& descriptor = fStateDescriptors[i];
+        descriptor.hints        = readDescriptorUInt32(p, end);
+        descriptor.key          = readDescriptorString(p, end);
+        descriptor.defaultValue = readDescriptorString(p, end);
+        descriptor.label        = readDescriptorString(p, end);
+        descriptor.description  = readDescriptorString(p, end);
+    }
+}
+
+void WasmPlugin::createInstance(WasmRuntime& runtime, Handles& handles)
+{
+    WasmHostFunctionMap hostFunc;
+    hostFunc["get_samplerate"] = MakeHostFunction(this, &WasmPlugin::getSampleRateF32);
+
+    runtime.createInstance(hostFunc);
+
+    runtime.setGlobal("_rw_num_inputs", MakeI32(DISTRHO_PLUGIN_NUM_INPUTS));
+    runtime.setGlobal("_rw_num_outputs", MakeI32(DISTRHO_PLUGIN_NUM_OUTPUTS));
+    runtime.setGlobal("_rw_block_frames", MakeI32(BLOCK_FRAMES));
+    runtime.setGlobal("_rw_midi_block_bytes", MakeI32(HIPHOP_WASM_MIDI_BUFFER_SIZE));
+
+    // Allocates the blocks sized above, they must exist before any other call
+    runtime.callFunction("init");
+
+    resolveHandles(runtime, handles);
+}
+
+void WasmPlugin::resolveHandles(WasmRuntime& runtime, Handles& handles)
+{
+    handles.getParameterValue = runtime.getFunctionHandle("get_parameter_value");
+    handles.setParameterValue = runtime.getFunctionHandle("set_parameter_value");
+    handles.run               = runtime.getFunctionHandle("run");
+    handles.collect           = runtime.getFunctionHandle("collect");
+    handles.inputBlock        = runtime.getGlobalHandle("_rw_input_block");
+    handles.outputBlock       = runtime.getGlobalHandle("_rw_output_block");
+    handles.midiBlock         = runtime.getGlobalHandle("_rw_midi_block");
+    handles.midiOutBlock      = runtime.getGlobalHandle("_rw_midi_out_block");
+    handles.midiOutBytes      = runtime.getGlobalHandle("_rw_midi_out_bytes");
+    handles.midiOutDropped    = runtime.getGlobalHandle("_rw_midi_out_dropped");
+    handles.parameterBlock    = runtime.getGlobalHandle("_rw_param_block");
+    handles.timeBlock         = runtime.getGlobalHandle("_rw_time_block");
+    handles.midiBlockBytes    = static_cast<uint32_t>(std::max<int32_t>(
+                                    runtime.getGlobal("_rw_midi_block_bytes").of.i32, 0));
 }
 
 void WasmPlugin::checkInstance(const char* caller) const
 {
     if (!fRuntime->hasInstance()) {
+        SUSPEND_ALLOCATION_GUARD();
         throw std::runtime_error(std::string(caller) + "() : missing wasm instance");
     }
 }
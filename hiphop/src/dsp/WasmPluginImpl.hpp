@@ -19,11 +19,83 @@
 #ifndef WASM_PLUGIN_IMPL_HPP
 #define WASM_PLUGIN_IMPL_HPP
 
+#include <atomic>
 #include <memory>
+#include <vector>
+
+#include "distrho/extra/Thread.hpp"
 
 #include "extra/PluginEx.hpp"
 #include "WasmRuntime.hpp"
+#include "Semaphore.hpp"
 #include "SpinLock.hpp"
+#include "WorkerPool.hpp"
+
+// Maximum number of frames processed by a single call into the module. Host
+// buffers are split into sub-blocks of this size, smaller blocks keep the
+// module working set cache resident. 0 only splits host buffers that do not
+// fit the module audio blocks.
+#ifndef HIPHOP_WASM_BLOCK_SIZE
+# define HIPHOP_WASM_BLOCK_SIZE 0
+#endif
+
+// Size in bytes of the MIDI input block allocated by the module on init.
+// SysEx messages not fitting the block are streamed over the next blocks using
+// a host side queue of HIPHOP_WASM_SYSEX_BUFFER_SIZE bytes.
+#ifndef HIPHOP_WASM_MIDI_BUFFER_SIZE
+# define HIPHOP_WASM_MIDI_BUFFER_SIZE 1536
+#endif
+
+#ifndef HIPHOP_WASM_SYSEX_BUFFER_SIZE
+# define HIPHOP_WASM_SYSEX_BUFFER_SIZE 65536
+#endif
+
+// Fault isolation for run(). A trap mutes the module until the next activate.
+// When HIPHOP_WASM_CPU_BUDGET is nonzero host buffers taking longer than that
+// percentage of their real-time duration are output as silence and counted as
+// overruns. After HIPHOP_WASM_MAX_OVERRUNS consecutive overruns the module is
+// skipped for as many buffers, then it runs again and is skipped again only if
+// that buffer also overruns.
+// Wasmer builds can additionally define HIPHOP_WASM_FUEL_PER_FRAME for making
+// run() trap after executing a number of operators proportional to the block
+// length, which is the only way to stop a module that never returns.
+#ifndef HIPHOP_WASM_CPU_BUDGET
+# define HIPHOP_WASM_CPU_BUDGET 0
+#endif
+
+#ifndef HIPHOP_WASM_MAX_OVERRUNS
+# define HIPHOP_WASM_MAX_OVERRUNS 8
+#endif
+
+// Number of threads running the module, including the audio thread, for plugins
+// setting voiceSharding. Notes are spread over HIPHOP_WASM_VOICE_SHARDS
+// instances of the module and their outputs are mixed. More shards than
+// workers balance uneven voice loads, idle workers steal pending shards. The
+// worker count can be overridden at run time with an environment variable of
+// the same name.
+#ifndef HIPHOP_WASM_VOICE_WORKERS
+# define HIPHOP_WASM_VOICE_WORKERS 0
+#endif
+
+// Microseconds idle voice workers poll for the next block before sleeping.
+// Spinning avoids the wake-up latency at small block sizes at the cost of CPU
+// time, 0 makes workers sleep as soon as they run out of shards.
+#ifndef HIPHOP_WASM_VOICE_SPIN_US
+# define HIPHOP_WASM_VOICE_SPIN_US 50
+#endif
+
+#if ! defined(HIPHOP_WASM_VOICE_SHARDS) || (HIPHOP_WASM_VOICE_SHARDS == 0)
+# undef HIPHOP_WASM_VOICE_SHARDS
+# define HIPHOP_WASM_VOICE_SHARDS HIPHOP_WASM_VOICE_WORKERS
+#endif
+
+#if HIPHOP_WASM_VOICE_SHARDS > 255
+# error HIPHOP_WASM_VOICE_SHARDS must not exceed 255
+#endif
+
+#ifndef HIPHOP_HOTSWAP_CROSSFADE_MS
+# define HIPHOP_HOTSWAP_CROSSFADE_MS 0
+#endif
 
 START_NAMESPACE_DISTRHO
 
@@ -32,7 +104,7 @@ class WasmPlugin : public PluginEx
 public:
     WasmPlugin(uint32_t parameterCount, uint32_t programCount, uint32_t stateCount,
                     std::shared_ptr<WasmRuntime> runtime = nullptr);
-    virtual ~WasmPlugin() {}
+    virtual ~WasmPlugin();
 
     const char* getLabel() const override;
     const char* getMaker() const override;
@@ -74,17 +146,315 @@ public:
     void loadWasmBinary(const unsigned char* data, size_t size);
 #endif // HIPHOP_SHARED_MEMORY_SIZE
 
-    WasmValueVector getTimePosition(WasmValueVector params);
-    WasmValueVector writeMidiEvent(WasmValueVector params);
+    // Safe to call from any thread. Counts are not reset on deactivate.
+    uint32_t getTrapCount() const noexcept { return fTrapCount; }
+    uint32_t getOverrunCount() const noexcept { return fOverrunCount; }
+    bool     isFaulted() const noexcept { return fFaulted; }
+    uint32_t getMidiDroppedEventCount() const noexcept { return fMidiDroppedEventCount; }
+    uint32_t getMemoryGrowBlockCount() const noexcept { return fMemoryGrowBlockCount; }
+    uint32_t getMidiOutputDroppedEventCount() const noexcept { return fMidiOutputDroppedEventCount; }
+#if defined(HIPHOP_WASM_GC_STATS)
+    uint32_t getGcBlockCount() const noexcept { return fGcBlockCount; }
+    uint64_t getGcTimeNs() const noexcept { return fGcTimeNs; }
+    uint64_t getGcMaxTimeNs() const noexcept { return fGcMaxTimeNs; }
+#endif
+#if HIPHOP_SHARED_MEMORY_SIZE && HIPHOP_HOTSWAP_CROSSFADE_MS
+    // Blocks that also ran a replaced instance during hot-swap crossfades
+    uint32_t getCrossfadeBlockCount() const noexcept { return fFadeBlockCount; }
+    uint64_t getCrossfadeTimeNs() const noexcept { return fFadeTimeNs; }
+#endif
+
+#if HIPHOP_WASM_VOICE_WORKERS
+    // Zero when the module does not enable voice sharding or the environment
+    // sets HIPHOP_WASM_VOICE_WORKERS to 0. Not safe to call while a module is
+    // being loaded.
+    uint32_t getVoiceShardCount() const noexcept { return static_cast<uint32_t>(fVoiceShards.size()); }
+    uint32_t getVoiceWorkerCount() const noexcept { return fVoicePool ? fVoicePool->getThreadCount() : 0; }
+#endif
 
 private:
+    struct Handles;
+
     void onModuleLoad();
+    void loadDescriptors();
+    void loadMetadata();
+    void createInstance(WasmRuntime& runtime, Handles& handles);
+
+    static void resolveHandles(WasmRuntime& runtime, Handles& handles);
+
+    // Host functions imported by the module
+    float getSampleRateF32() const { return static_cast<float>(getSampleRate()); }
 
     inline void checkInstance(const char* caller) const;
 
-    bool fActive;
+    void     applyParameterChanges();
+    void     markAllParametersChanged();
+    template<class F>
+    uint32_t takeParameterChanges(uint32_t maxCount, F callback);
+    void     setInstanceParameterValue(uint32_t index, float value);
+    uint32_t writeParameterEvents();
+    void updateOutputParameters();
+    void refreshParameterValues();
+
+    void runBuffer(const float** inputs, float** outputs, uint32_t frames,
+                    const MidiEvent* midiEvents, uint32_t midiEventCount);
+    void runBlock(const float** inputs, float** outputs, uint32_t frames, uint32_t frameOffset,
+                    const MidiEvent* midiEvents, uint32_t midiEventCount,
+                    uint32_t parameterEventCount);
+    void runInstance(WasmRuntime& runtime, const Handles& handles, const float** inputs,
+                        float** outputs, uint32_t frames, uint32_t frameOffset,
+                        uint32_t midiEventCount, uint32_t midiBytes,
+                        uint32_t parameterEventCount);
+    void writeInstanceInput(WasmRuntime& runtime, const Handles& handles, const float** inputs,
+                            uint32_t frames, uint32_t frameOffset);
+
+#if HIPHOP_WASM_VOICE_WORKERS
+    void createVoiceShards();
+    void runVoiceShards(const float** inputs, float** outputs, uint32_t frames, uint32_t frameOffset,
+                        uint32_t midiBytes, uint32_t parameterEventCount);
+    void routeMidiInput(uint32_t midiBytes);
+    int  routeMidiEvent(const uint8_t* data, uint32_t size);
+    void resetVoiceRouting();
+
+    static void runVoiceShard(void* context, uint32_t index);
+#endif
+
+    void onRunFault(WasmRuntime& runtime);
+#if HIPHOP_WASM_CPU_BUDGET
+    bool checkCpuBudget(uint32_t frames, uint64_t elapsedNs);
+#endif
+    static void writeSilence(float** outputs, uint32_t frames);
+
+    uint32_t writeMidiInput(uint32_t frames, uint32_t frameOffset, const MidiEvent* midiEvents,
+                            uint32_t midiEventCount, uint32_t& midiBytes);
+    bool     queuePendingSysex(const uint8_t* data, uint32_t size);
+
+    static void     writeMidiInputEvent(byte_t* p, uint32_t frame, const uint8_t* data, uint32_t size);
+    static uint32_t fitMidiInput(const byte_t* p, uint32_t size, uint32_t capacity,
+                                    uint32_t& eventCount);
+#if DISTRHO_PLUGIN_WANT_TIMEPOS
+    void writeTimePosition(byte_t* timeBlock, uint32_t frameOffset);
+#endif
+#if DISTRHO_PLUGIN_WANT_MIDI_OUTPUT
+    void writeMidiOutput(uint32_t frames, uint32_t frameOffset);
+#endif
+
+#if HIPHOP_SHARED_MEMORY_SIZE
+    void loaderThreadRun();
+    bool takePendingBinary(std::vector<unsigned char>& binary);
+    void loadPendingBinary(const std::vector<unsigned char>& binary);
+    void updatePendingActivation();
+    void adoptPendingInstance();
+    void collectRetiredInstance();
+# if HIPHOP_HOTSWAP_CROSSFADE_MS
+    void runCrossfade(const float** inputs, float** outputs, uint32_t frames,
+                        uint32_t frameOffset, uint32_t midiEventCount, uint32_t midiBytes,
+                        uint32_t parameterEventCount);
+    void finishCrossfade();
+# endif
+#endif
+
+    // Exports used by frequently called methods, resolved once per instance
+    struct Handles
+    {
+        WasmFunctionHandle getParameterValue;
+        WasmFunctionHandle setParameterValue;
+        WasmFunctionHandle run;
+        WasmFunctionHandle collect;
+        WasmGlobalHandle   inputBlock;
+        WasmGlobalHandle   outputBlock;
+        WasmGlobalHandle   midiBlock;
+        WasmGlobalHandle   midiOutBlock;
+        WasmGlobalHandle   midiOutBytes;
+        WasmGlobalHandle   midiOutDropped;
+        WasmGlobalHandle   parameterBlock;
+        WasmGlobalHandle   timeBlock;
+        uint32_t           midiBlockBytes; // as allocated by the module
+    };
+
+    // Parsed once from the table returned by get_descriptors()
+    struct ParameterDescriptor
+    {
+        uint32_t hints;
+        float    def;
+        float    min;
+        float    max;
+        String   name;
+    };
+
+    struct StateDescriptor
+    {
+        uint32_t hints;
+        String   key;
+        String   defaultValue;
+        String   label;
+        String   description;
+    };
+
+    // Static metadata read once from the first loaded module, getters never
+    // enter the VM. Hosts call them repeatedly while scanning.
+    String                       fLabel;
+    String                       fMaker;
+    String                       fLicense;
+    uint32_t                     fVersion;
+    int64_t                      fUniqueId;
+
+    uint32_t                     fParameterCount;
+    uint32_t                     fProgramCount;
+    uint32_t                     fStateCount;
+    std::vector<ParameterDescriptor> fParameterDescriptors;
+    std::vector<String>          fProgramNames;
+    std::vector<StateDescriptor> fStateDescriptors;
+    std::atomic<bool>            fActive;
     std::shared_ptr<WasmRuntime> fRuntime;
     mutable SpinLock             fRuntimeLock;
+    Handles                      fHandles;
+
+    // Host and UI threads never enter the VM for parameters. Values are read
+    // from an atomic mirror, writes also set a per-index bit that the audio
+    // thread clears when handing the current value to the module before the
+    // next block. Any number of threads can write without locking, repeated
+    // writes to the same index between two blocks result in a single event.
+    std::unique_ptr<std::atomic<float>[]>    fParameterValues;
+    std::unique_ptr<std::atomic<uint32_t>[]> fParameterChangedBits;
+    uint32_t                     fParameterChangedWords;
+    std::atomic<bool>            fParameterChanged;
+    std::vector<uint32_t>        fOutputParameters;
+
+    // MIDI input serialized once per block and SysEx waiting to be streamed.
+    // Sized on activate, only touched by the audio thread afterwards. Events
+    // not fitting the block or the SysEx queue are counted as dropped.
+    std::vector<byte_t>          fMidiInput;
+    std::vector<uint8_t>         fMidiPending;
+    uint32_t                     fMidiPendingRead;
+    uint32_t                     fMidiPendingWrite;
+    std::atomic<uint32_t>        fMidiDroppedEventCount;
+
+    // Output events not fitting the module block or rejected by the host
+    std::atomic<uint32_t>        fMidiOutputDroppedEventCount;
+
+    // Blocks during which the module grew its memory, written by the audio
+    // thread. Initial memory is set at build time by HIPHOP_WASM_INITIAL_MEMORY.
+    std::atomic<uint32_t>        fMemoryGrowBlockCount;
+
+    // Set by the audio thread after a trap, the module is not entered from
+    // run() again until the next activate or hot-swap
+    std::atomic<bool>            fFaulted;
+    std::atomic<uint32_t>        fTrapCount;
+    std::atomic<uint32_t>        fOverrunCount;
+    uint32_t                     fConsecutiveOverruns;
+    uint32_t                     fOverrunSkipCount; // buffers left to skip
+
+#if HIPHOP_WASM_VOICE_WORKERS
+    // Instances rendering a share of the notes each, the first one is fRuntime.
+    // Created on load when the module sets voiceSharding, otherwise empty. The
+    // audio thread writes inputs and mixes outputs, the pool only runs them.
+    struct VoiceShard
+    {
+        std::shared_ptr<WasmRuntime> runtime;
+        Handles                      handles;
+        byte_t*                      midiBlock;
+        uint32_t                     midiBytes;
+        uint32_t                     midiEventCount;
+        uint32_t                     memoryGrowCount;
+        uint32_t                     activeNotes;
+        bool                         faulted;
+    };
+
+    std::vector<VoiceShard>      fVoiceShards;
+    std::unique_ptr<WorkerPool>  fVoicePool;
+    uint32_t                     fVoiceFrames;
+    uint32_t                     fVoiceParameterEventCount;
+    uint32_t                     fVoiceNextShard;
+    uint8_t                      fVoiceNoteShard[16 * 128]; // shard + 1 by channel and note, 0 if free
+#endif
+
+#if defined(HIPHOP_WASM_GC_STATS)
+    // Time spent in AS GC after each block, written by the audio thread
+    std::atomic<uint32_t>        fGcBlockCount;
+    std::atomic<uint64_t>        fGcTimeNs;
+    std::atomic<uint64_t>        fGcMaxTimeNs;
+#endif
+
+#if HIPHOP_SHARED_MEMORY_SIZE
+    // Hot-swapped binaries are compiled and instantiated by the loader thread.
+    // The result is published through fPendingInstance and adopted by the audio
+    // thread at the start of the next block, the replaced runtime travels back
+    // through fRetiredInstance so it is never destroyed on the audio thread.
+    // The loader thread sleeps until woken by a new binary, a pending instance
+    // whose activation state is stale, or a retired instance to destroy.
+
+    struct Instance
+    {
+        std::shared_ptr<WasmRuntime> runtime;
+        Handles                      handles;
+        bool                         active; // activate() was called on runtime
+    };
+
+    class LoaderThread : public Thread
+    {
+    public:
+        LoaderThread(WasmPlugin* plugin)
+            : Thread("wasm_loader")
+            , fPlugin(plugin)
+        {}
+
+        void wakeUp() noexcept
+        {
+            fSemaphore.post();
+        }
+
+        void stop()
+        {
+            signalThreadShouldExit();
+            fSemaphore.post();
+            stopThread(-1);
+        }
+
+    protected:
+        void run() override
+        {
+            while (! shouldThreadExit()) {
+                fSemaphore.wait();
+
+                if (! shouldThreadExit()) {
+                    fPlugin->loaderThreadRun();
+                }
+            }
+        }
+
+    private:
+        WasmPlugin* fPlugin;
+        Semaphore   fSemaphore;
+
+    };
+
+    // Started on the first hot-swap, most instances never need it
+    LoaderThread                 fLoaderThread;
+    std::atomic<bool>            fLoaderStarted;
+
+    // The binary is copied into a buffer owned by the plugin and handed over
+    // through a sequence lock, writers make the sequence odd while updating
+    // buffer and size. The loader thread copies the buffer and retries if the
+    // sequence changed meanwhile. Allocated on the first hot-swap.
+    std::atomic<uint32_t>        fPendingBinarySequence;
+    std::unique_ptr<unsigned char[]> fPendingBinary;
+    std::atomic<size_t>          fPendingBinarySize;
+    uint32_t                     fLoadedBinarySequence; // loader thread only
+    std::atomic<Instance*>       fPendingInstance;
+    std::atomic<Instance*>       fRetiredInstance;
+# if HIPHOP_HOTSWAP_CROSSFADE_MS
+    // The replaced instance keeps running until the crossfade completes. Only
+    // the audio thread touches these, or the loader thread while inactive.
+    Instance*                    fFadingInstance;
+    uint32_t                     fFadePosition;
+    uint32_t                     fFadeLength;
+    std::vector<float>           fFadeBuffer;
+    // Time spent running the replaced instance, written by the audio thread
+    std::atomic<uint32_t>        fFadeBlockCount;
+    std::atomic<uint64_t>        fFadeTimeNs;
+# endif
+#endif // HIPHOP_SHARED_MEMORY_SIZE
 
     DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WasmPlugin)
 
@@ -16,34 +16,39 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
 
 #include "WasmRuntime.hpp"
+#include "AllocationGuard.hpp"
+#include "MappedFile.hpp"
 
 #define MAX_STRING_SIZE    1024
-#define MAX_HOST_FUNCTIONS 1024
+#define WASM_PAGE_SIZE     65536
 
 WasmRuntime::WasmRuntime()
-    : fEngine(nullptr)
-    , fStore(nullptr)
-    , fModule(nullptr)
+    : fStore(nullptr)
+    , fModeName(nullptr)
     , fInstance(nullptr)
+    , fInstanceId(0)
+    , fMemory(nullptr)
+    , fMemoryData(nullptr)
+    , fMemoryPages(0)
+    , fMemoryGrowCount(0)
 #if HIPHOP_PLUGIN_WASM_WASI
     , fWasiEnv(nullptr)
 #endif
 {
     std::memset(&fExportsVec, 0, sizeof(fExportsVec));
 
-    fEngine = fLib.wasm_engine_new();
-    if (fEngine == nullptr) {
-        throw wasm_runtime_exception("wasm_engine_new() failed");
-    }
+    // Engine and compiled modules are shared by all runtimes in the process,
+    // each runtime only owns a store and an instance
+    fEngine = WasmEngine::getInstance();
 
-    fStore = fLib.wasm_store_new(fEngine); 
+    fStore = fLib.wasm_store_new(fEngine->getEngine());
     if (fStore == nullptr) {
-        fLib.wasm_engine_delete(fEngine);
         throw wasm_runtime_exception("wasm_store_new() failed");
     }
 }
@@ -58,11 +63,6 @@ WasmRuntime::~WasmRuntime()
         fLib.wasm_store_delete(fStore);
         fStore = nullptr;
     }
-
-    if (fEngine != nullptr) {
-        fLib.wasm_engine_delete(fEngine);
-        fEngine = nullptr;
-    }
 }
 
 void WasmRuntime::load(const char* modulePath)
@@ -71,33 +71,16 @@ void WasmRuntime::load(const char* modulePath)
         destroyInstance();
     }
 
-    std::FILE* file = std::fopen(modulePath, "rb");
-    if (file == nullptr) {
-        throw wasm_module_exception("Error opening module file");
-    }
-
-    std::fseek(file, 0L, SEEK_END);
-    const size_t fileSize = std::ftell(file);
-    std::fseek(file, 0L, SEEK_SET);
-
-    wasm_byte_vec_t moduleBytes;
-    fLib.wasm_byte_vec_new_uninitialized(&moduleBytes, fileSize);
-    
-    size_t bytesRead = std::fread(moduleBytes.data, 1, fileSize, file);
-    std::fclose(file);
+    // Map the file instead of reading it into a temporary buffer, the runtime
+    // reads the module straight from the page cache while compiling
+    const MappedFile file (modulePath);
 
-    if (bytesRead != fileSize) {
-        fLib.wasm_byte_vec_delete(&moduleBytes);
-        throw wasm_module_exception("Error reading module file");
+    if (! file.isValid()) {
+        throw wasm_module_exception("Error opening module file");
     }
 
-    // Following call crashes some DAWs on Windows when running Wasmer runtime.
-    fModule = fLib.wasm_module_new(fStore, &moduleBytes);
-    fLib.wasm_byte_vec_delete(&moduleBytes);
-
-    if (fModule == nullptr) {
-        throw wasm_runtime_exception("wasm_module_new() failed");
-    }
+    fModule = fEngine->getModule(file.getData(), file.getSize());
+    fModeName = detectModeName(file.getData(), file.getSize());
 }
 
 void WasmRuntime::load(const unsigned char* moduleData, size_t size)
@@ -106,17 +89,22 @@ void WasmRuntime::load(const unsigned char* moduleData, size_t size)
         destroyInstance();
     }
 
-    wasm_byte_vec_t moduleBytes;
-    fLib.wasm_byte_vec_new_uninitialized(&moduleBytes, size);
-
-    std::memcpy(moduleBytes.data, moduleData, size);
+    fModule = fEngine->getModule(moduleData, size);
+    fModeName = detectModeName(moduleData, size);
+}
 
-    fModule = fLib.wasm_module_new(fStore, &moduleBytes);
-    fLib.wasm_byte_vec_delete(&moduleBytes);
+void WasmRuntime::load(const WasmRuntime& other)
+{
+    if (hasInstance()) {
+        destroyInstance();
+    }
 
-    if (fModule == nullptr) {
-        throw wasm_runtime_exception("wasm_module_new() failed");
+    if (other.fModule == nullptr) {
+        throw wasm_module_exception("Other runtime has no module");
     }
+
+    fModule = other.fModule;
+    fModeName = other.fModeName;
 }
 
 bool WasmRuntime::hasInstance()
@@ -124,7 +112,35 @@ bool WasmRuntime::hasInstance()
     return fInstance != nullptr;
 }
 
-void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
+bool WasmRuntime::isSimdSupported()
+{
+    return fEngine->isSimdSupported();
+}
+
+const char* WasmRuntime::getModeName()
+{
+    return fModeName;
+}
+
+const char* WasmRuntime::detectModeName(const unsigned char* moduleData, size_t size)
+{
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+    // WAMR accepts both formats when built with AOT and interpreter support
+    // enabled, tell them apart by the magic number
+    if ((size >= 4) && (std::memcmp(moduleData, "\0aot", 4) == 0)) {
+        return "aot";
+    }
+
+    return "interp";
+#elif defined(HIPHOP_WASM_RUNTIME_WASMER)
+    (void)moduleData;
+    (void)size;
+
+    return "jit";
+#endif
+}
+
+void WasmRuntime::createInstance(const WasmHostFunctionMap& hostFunctions)
 {
     if (hasInstance()) {
         destroyInstance();
@@ -146,7 +162,7 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
 
     wasmer_named_extern_vec_t wasiImports;
 
-    if (!wasi_get_unordered_imports(fStore, fModule, fWasiEnv, &wasiImports)) {
+    if (!wasi_get_unordered_imports(fStore, fModule->get(), fWasiEnv, &wasiImports)) {
         throw wasm_runtime_exception("wasi_get_unordered_imports() failed");
     }
 
@@ -164,7 +180,7 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
     // Build module imports vector
 
     wasm_importtype_vec_t importTypes;
-    fLib.wasm_module_imports(fModule, &importTypes);
+    fLib.wasm_module_imports(fModule->get(), &importTypes);
     wasm_extern_vec_t imports;
     fLib.wasm_extern_vec_new_uninitialized(&imports, importTypes.size);
 #if defined(HIPHOP_WASM_RUNTIME_WAMR)
@@ -179,6 +195,7 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
         std::memcpy(name, wn->data, wn->size);
         name[wn->size] = '\0';
         importIndex[name] = i;
+        imports.data[i] = nullptr;
 
 #if HIPHOP_PLUGIN_WASM_WASI
         if (wasiImportIndex.find(name) != wasiImportIndex.end()) {
@@ -208,37 +225,51 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
     }
 #endif
 
-    // Insert host functions into imports vector
+    // Insert host functions into imports vector. Callbacks are static and
+    // receive the bound object as env, the runtime keeps no per-function state.
 
-    // Avoid reallocation to ensure pointers to elements remain valid through engine lifetime
-    fHostFunctions.reserve(MAX_HOST_FUNCTIONS);
+    for (WasmHostFunctionMap::const_iterator it = hostFunctions.cbegin(); it != hostFunctions.cend(); ++it) {
+        const std::unordered_map<std::string, int>::const_iterator index = importIndex.find(it->first);
 
-    for (WasmFunctionMap::const_iterator it = hostFunctions.cbegin(); it != hostFunctions.cend(); ++it) {
-        fHostFunctions.push_back(it->second.function);
+        if (index == importIndex.end()) {
+            continue; // not used by the module
+        }
 
         wasm_valtype_vec_t params;
         toCValueTypeVector(it->second.params, &params);
         wasm_valtype_vec_t result;
         toCValueTypeVector(it->second.result, &result);
 
-        const wasm_functype_t* funcType = fLib.wasm_functype_new(&params, &result);
-        wasm_func_t* func = fLib.wasm_func_new_with_env(fStore, funcType, WasmRuntime::callHostFunction,
-                                                        &fHostFunctions.back(), nullptr);
-        imports.data[importIndex[it->first]] = fLib.wasm_func_as_extern(func);
+        own wasm_functype_t* funcType = fLib.wasm_functype_new(&params, &result);
+        wasm_func_t* func = fLib.wasm_func_new_with_env(fStore, funcType, it->second.callback,
+                                                        it->second.env, nullptr);
+        imports.data[index->second] = fLib.wasm_func_as_extern(func);
 
+        fLib.wasm_functype_delete(funcType); // func keeps its own copy
         fLib.wasm_valtype_vec_delete(&result);
         fLib.wasm_valtype_vec_delete(&params);
     }
 
+    for (std::unordered_map<std::string, int>::const_iterator it = importIndex.cbegin(); it != importIndex.cend(); ++it) {
+        if (imports.data[it->second] == nullptr) {
+            fLib.wasm_extern_vec_delete(&imports);
+            throw wasm_module_exception(std::string("Missing host function ") + it->first);
+        }
+    }
+
     // Create instance and start WASI if needed
 
-    fInstance = fLib.wasm_instance_new(fStore, fModule, &imports, nullptr);
+    fInstance = fLib.wasm_instance_new(fStore, fModule->get(), &imports, nullptr);
 
     fLib.wasm_extern_vec_delete(&imports);
 
     if (fInstance == nullptr) {
         throw wasm_runtime_exception("wasm_instance_new() failed");
     }
+
+    // Process wide serial, tells snapshots of different instances apart
+    static std::atomic<uint64_t> instanceSerial(0);
+    fInstanceId = ++instanceSerial;
     
 #if HIPHOP_PLUGIN_WASM_WASI
     wasm_func_t* wasiStart = wasi_get_start_function(fInstance);
@@ -257,7 +288,7 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
     fExportsVec.size = 0;
     fLib.wasm_instance_exports(fInstance, &fExportsVec);
     wasm_exporttype_vec_t exportTypes;
-    fLib.wasm_module_exports(fModule, &exportTypes);
+    fLib.wasm_module_exports(fModule->get(), &exportTypes);
 
     for (size_t i = 0; i < fExportsVec.size; i++) {
         const wasm_name_t *wn = fLib.wasm_exporttype_name(exportTypes.data[i]);
@@ -267,15 +298,16 @@ void WasmRuntime::createInstance(WasmFunctionMap hostFunctions)
     }
 
     fLib.wasm_exporttype_vec_delete(&exportTypes);
+
+    wasm_extern_t* memory = findExport("memory");
+    fMemory = memory != nullptr ? fLib.wasm_extern_as_memory(memory) : nullptr;
+    fMemoryData = fMemory != nullptr ? fLib.wasm_memory_data(fMemory) : nullptr;
+    fMemoryPages = fMemory != nullptr ? fLib.wasm_memory_size(fMemory) : 0;
+    fMemoryGrowCount = 0;
 }
 
 void WasmRuntime::destroyInstance()
 {
-    if (fModule != nullptr) {
-        fLib.wasm_module_delete(fModule);
-        fModule = nullptr;
-    }
-
 #if HIPHOP_PLUGIN_WASM_WASI
     if (fWasiEnv != nullptr) {
         wasi_env_delete(fWasiEnv);
@@ -293,15 +325,155 @@ void WasmRuntime::destroyInstance()
         fInstance = nullptr;
     }
 
-    fHostFunctions.clear();
+    // Release after the instance, the module is shared and may outlive it
+    fModule.reset();
+
     fModuleExports.clear();
+    fMemory = nullptr;
+    fMemoryData = nullptr;
+    fMemoryPages = 0;
+}
+
+WasmFunctionHandle WasmRuntime::getFunctionHandle(const char* name)
+{
+    wasm_extern_t* ext = findExport(name);
+
+    if (ext == nullptr) {
+        throw wasm_module_exception(std::string("Wasm module does not export function ") + name);
+    }
+
+    return fLib.wasm_extern_as_func(ext);
+}
+
+WasmGlobalHandle WasmRuntime::getGlobalHandle(const char* name)
+{
+    wasm_extern_t* ext = findExport(name);
+
+    if (ext == nullptr) {
+        throw wasm_module_exception(std::string("Wasm module does not export global ") + name);
+    }
+
+    return fLib.wasm_extern_as_global(ext);
+}
+
+WasmMemoryHandle WasmRuntime::getMemoryHandle()
+{
+    if (fMemory == nullptr) {
+        throw wasm_module_exception("Wasm module does not export memory");
+    }
+
+    return fMemory;
+}
+
+void WasmRuntime::reserveMemory(uint32_t pages)
+{
+    const uint32_t current = fLib.wasm_memory_size(getMemoryHandle());
+
+    if (pages <= current) {
+        return;
+    }
+
+    if (! fLib.wasm_memory_grow(fMemory, pages - current)) {
+        throw wasm_runtime_exception("wasm_memory_grow() failed");
+    }
+
+    // Not a growth caused by the module, do not count it
+    fMemoryData = fLib.wasm_memory_data(fMemory);
+    fMemoryPages = fLib.wasm_memory_size(fMemory);
 }
 
+bool WasmRuntime::updateMemory()
+{
+    if (fMemory == nullptr) {
+        return false;
+    }
+
+    const uint32_t pages = fLib.wasm_memory_size(fMemory);
+
+    if (pages == fMemoryPages) {
+        return false;
+    }
+
+    fMemoryData = fLib.wasm_memory_data(fMemory);
+    fMemoryPages = pages;
+    fMemoryGrowCount++;
+
+    return true;
+}
+
+std::shared_ptr<const WasmSnapshot> WasmRuntime::takeSnapshot()
+{
+    if (! hasInstance()) {
+        throw wasm_runtime_exception("No instance to take a snapshot from");
+    }
+
+    std::shared_ptr<WasmSnapshot> snapshot (new WasmSnapshot);
+    snapshot->instanceId = fInstanceId;
+
+    if (fMemory != nullptr) {
+        updateMemory();
+        const size_t size = static_cast<size_t>(fMemoryPages) * WASM_PAGE_SIZE;
+        snapshot->memory.assign(fMemoryData, fMemoryData + size);
+    }
+
+    for (WasmExternMap::const_iterator it = fModuleExports.cbegin(); it != fModuleExports.cend(); ++it) {
+        wasm_global_t* global = fLib.wasm_extern_as_global(it->second);
+
+        if (global == nullptr) {
+            continue;
+        }
+
+        own wasm_globaltype_t* type = fLib.wasm_global_type(global);
+        const bool mutableGlobal = fLib.wasm_globaltype_mutability(type) == WASM_VAR;
+        fLib.wasm_globaltype_delete(type);
+
+        if (mutableGlobal) {
+            snapshot->globals.push_back(std::make_pair(it->first, getGlobal(global)));
+        }
+    }
+
+    return snapshot;
+}
+
+void WasmRuntime::restoreSnapshot(const WasmSnapshot& snapshot)
+{
+    if (! hasInstance()) {
+        throw wasm_runtime_exception("No instance to restore a snapshot into");
+    }
+
+    if (snapshot.instanceId != fInstanceId) {
+        throw wasm_runtime_exception("Snapshot was taken from a different instance");
+    }
+
+    if (! snapshot.memory.empty()) {
+        // Memory cannot shrink, pages the snapshot does not cover are zeroed
+        reserveMemory(static_cast<uint32_t>(snapshot.memory.size() / WASM_PAGE_SIZE));
+        const size_t size = static_cast<size_t>(fMemoryPages) * WASM_PAGE_SIZE;
+        std::memcpy(fMemoryData, snapshot.memory.data(), snapshot.memory.size());
+        std::memset(fMemoryData + snapshot.memory.size(), 0, size - snapshot.memory.size());
+    }
+
+    for (WasmSnapshot::GlobalVector::const_iterator it = snapshot.globals.cbegin();
+            it != snapshot.globals.cend(); ++it) {
+        setGlobal(it->first.c_str(), it->second);
+    }
+}
+
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+void WasmRuntime::setFuel(uint64_t fuel)
+{
+    wasmer_metering_set_remaining_points(fInstance, fuel);
+}
+
+bool WasmRuntime::isFuelExhausted()
+{
+    return wasmer_metering_points_are_exhausted(fInstance);
+}
+#endif
+
 byte_t* WasmRuntime::getMemory(const WasmValue& wPtr)
 {
-    return fLib.wasm_memory_data(
-        fLib.wasm_extern_as_memory(fModuleExports["memory"])
-    ) + wPtr.of.i32;
+    return fMemoryData + wPtr.of.i32;
 }
 
 char* WasmRuntime::getMemoryAsCString(const WasmValue& wPtr)
@@ -315,15 +487,25 @@ void WasmRuntime::copyCStringToMemory(const WasmValue& wPtr, const char* s)
 }
 
 WasmValue WasmRuntime::getGlobal(const char* name)
+{
+    return getGlobal(getGlobalHandle(name));
+}
+
+WasmValue WasmRuntime::getGlobal(WasmGlobalHandle global)
 {
     wasm_val_t value;
-    fLib.wasm_global_get(fLib.wasm_extern_as_global(fModuleExports[name]), &value);
+    fLib.wasm_global_get(global, &value);
     return value;
 }
 
 void WasmRuntime::setGlobal(const char* name, const WasmValue& value)
 {
-    fLib.wasm_global_set(fLib.wasm_extern_as_global(fModuleExports[name]), &value);
+    setGlobal(getGlobalHandle(name), value);
+}
+
+void WasmRuntime::setGlobal(WasmGlobalHandle global, const WasmValue& value)
+{
+    fLib.wasm_global_set(global, &value);
 }
 
 char* WasmRuntime::getGlobalAsCString(const char* name)
@@ -333,8 +515,11 @@ char* WasmRuntime::getGlobalAsCString(const char* name)
 
 WasmValueVector WasmRuntime::callFunction(const char* name, WasmValueVector params)
 {
-    const wasm_func_t* func = fLib.wasm_extern_as_func(fModuleExports[name]);
+    return callFunction(getFunctionHandle(name), params);
+}
 
+WasmValueVector WasmRuntime::callFunction(WasmFunctionHandle function, WasmValueVector params)
+{
     // https://stackoverflow.com/questions/10078283/how-sizeofarray-works-at-runtime
     wasm_val_t paramsArray[params.size()];
     std::copy(params.begin(), params.end(), paramsArray);
@@ -343,19 +528,13 @@ WasmValueVector WasmRuntime::callFunction(const char* name, WasmValueVector para
     wasm_val_t resultArray[1] = { WASM_INIT_VAL };
     wasm_val_vec_t resultVec = WASM_ARRAY_VEC(resultArray);
 
-    const wasm_trap_t* trap = fLib.wasm_func_call(func, &paramsVec, &resultVec);
-
-    if (trap != nullptr) {
-        std::string s = std::string("Failed call to function ") + name;
-
-        wasm_message_t* wm = nullptr;
-        fLib.wasm_trap_message(trap, wm);
+    own wasm_trap_t* trap = fLib.wasm_func_call(function, &paramsVec, &resultVec);
 
-        if (wm != nullptr) {
-            s += std::string(" - trap message: ") + std::string(wm->data /*null terminated*/);
-        }
+    // Also after a trap, the module might have grown memory before it
+    updateMemory();
 
-        throw wasm_runtime_exception(s);
+    if (trap != nullptr) {
+        throwTrap(trap, function);
     }
 
     return WasmValueVector(resultVec.data, resultVec.data + resultVec.size);
@@ -366,22 +545,14 @@ WasmValue WasmRuntime::callFunctionReturnSingleValue(const char* name, WasmValue
     return callFunction(name, params)[0];
 }
 
-const char* WasmRuntime::callFunctionReturnCString(const char* name, WasmValueVector params)
+WasmValue WasmRuntime::callFunctionReturnSingleValue(WasmFunctionHandle function, WasmValueVector params)
 {
-    return getMemoryAsCString(callFunctionReturnSingleValue(name, params));
+    return callFunction(function, params)[0];
 }
 
-wasm_trap_t* WasmRuntime::callHostFunction(void* env, const wasm_val_vec_t* paramsVec, wasm_val_vec_t* resultVec)
+const char* WasmRuntime::callFunctionReturnCString(const char* name, WasmValueVector params)
 {
-    const WasmFunction* func = static_cast<WasmFunction *>(env);
-    const WasmValueVector params (paramsVec->data, paramsVec->data + paramsVec->size);
-    const WasmValueVector result = (*func)(params);
-
-    for (size_t i = 0; i < resultVec->size; i++) {
-        resultVec->data[i] = result[i];
-    }
-
-    return nullptr;
+    return getMemoryAsCString(callFunctionReturnSingleValue(name, params));
 }
 
 own void WasmRuntime::toCValueTypeVector(WasmValueKindVector kinds, own wasm_valtype_vec_t* out)
@@ -397,9 +568,48 @@ own void WasmRuntime::toCValueTypeVector(WasmValueKindVector kinds, own wasm_val
     fLib.wasm_valtype_vec_new(out, size, typesArray);
 }
 
+wasm_extern_t* WasmRuntime::findExport(const char* name)
+{
+    const WasmExternMap::const_iterator it = fModuleExports.find(name);
+    return it != fModuleExports.end() ? it->second : nullptr;
+}
+
+const char* WasmRuntime::findExportName(const void* handle)
+{
+    // Only called for building error messages, linear search is fine
+    for (WasmExternMap::const_iterator it = fModuleExports.cbegin(); it != fModuleExports.cend(); ++it) {
+        if ((fLib.wasm_extern_as_func(it->second) == handle)
+                || (fLib.wasm_extern_as_global(it->second) == handle)) {
+            return it->first.c_str();
+        }
+    }
+
+    return "(unknown)";
+}
+
+void WasmRuntime::throwTrap(own wasm_trap_t* trap, WasmFunctionHandle function)
+{
+    // Traps can happen on the audio thread, building the message allocates
+    SUSPEND_ALLOCATION_GUARD();
+
+    std::string s = std::string("Failed call to function ") + findExportName(function);
+
+    wasm_message_t wm = WASM_EMPTY_VEC;
+    fLib.wasm_trap_message(trap, &wm);
+
+    if (wm.size > 0) {
+        s += std::string(" - trap message: ") + std::string(wm.data, strnlen(wm.data, wm.size));
+    }
+
+    fLib.wasm_byte_vec_delete(&wm);
+    fLib.wasm_trap_delete(trap);
+
+    throw wasm_runtime_exception(s);
+}
+
 const char* WasmRuntime::WTF16ToCString(const WasmValue& wPtr)
 {
-    if (fModuleExports.find("wtf16_to_c_string") == fModuleExports.end()) {
+    if (findExport("wtf16_to_c_string") == nullptr) {
         throw wasm_module_exception("Wasm module does not export function _wtf16_to_c_string");
     }
 
@@ -408,7 +618,7 @@ const char* WasmRuntime::WTF16ToCString(const WasmValue& wPtr)
 
 WasmValue WasmRuntime::CToWTF16String(const char* s)
 {
-    if (fModuleExports.find("c_to_wtf16_string") == fModuleExports.end()) {
+    if (findExport("c_to_wtf16_string") == nullptr) {
         throw wasm_module_exception("Wasm module does not export function _c_to_wtf16_string");
     }
 
@@ -19,7 +19,8 @@
 #ifndef WASM_RUNTIME_HPP
 #define WASM_RUNTIME_HPP
 
-#include <functional>
+#include <cstddef>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
@@ -29,11 +30,15 @@
 #include "distrho/extra/LeakDetector.hpp"
 
 #include "WasmCApi.hpp"
+#include "WasmEngine.hpp"
 
 #if defined(HIPHOP_WASM_RUNTIME_WAMR)
 # if HIPHOP_PLUGIN_WASM_WASI
 #  error WAMR C API does not support WASI
 # endif
+# if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+#  error WAMR C API does not support execution metering
+# endif
 #endif
 
 #define MakeI32(x) WASM_I32_VAL(static_cast<int32_t>(x))
@@ -41,23 +46,187 @@
 #define MakeF32(x) WASM_F32_VAL(static_cast<float32_t>(x))
 #define MakeF64(x) WASM_F64_VAL(static_cast<float64_t>(x))
 
+// Binds a member function to a host import, eg. MakeHostFunction(this, &C::f)
+// The object is not owned and must outlive the instance.
+#define MakeHostFunction(obj, method) WasmHostMethod<decltype(method), method>::bind(obj)
+
 START_NAMESPACE_DISTRHO
 
-struct WasmFunctionDescriptor;
+struct WasmHostFunction;
 
 typedef wasm_val_t WasmValue;
 typedef std::vector<WasmValue> WasmValueVector;
 typedef std::vector<enum wasm_valkind_enum> WasmValueKindVector;
-typedef std::function<WasmValueVector(WasmValueVector)> WasmFunction;
-typedef std::vector<WasmFunction> WasmFunctionVector;
-typedef std::unordered_map<std::string, WasmFunctionDescriptor> WasmFunctionMap;
+typedef std::unordered_map<std::string, WasmHostFunction> WasmHostFunctionMap;
 typedef std::unordered_map<std::string, wasm_extern_t*> WasmExternMap;
 
-struct WasmFunctionDescriptor
+// Handles are resolved once after instantiation and remain valid until the
+// instance is destroyed. They allow hot paths to skip export name lookups.
+
+typedef wasm_func_t*   WasmFunctionHandle;
+typedef wasm_global_t* WasmGlobalHandle;
+typedef wasm_memory_t* WasmMemoryHandle;
+
+// Host import passed to the runtime as is. The callback receives env and reads
+// arguments and writes results in place, see WasmHostMethod.
+
+struct WasmHostFunction
+{
+    WasmValueKindVector           params;
+    WasmValueKindVector           result;
+    wasm_func_callback_with_env_t callback;
+    void*                         env;
+};
+
+// Copy of an instance linear memory and exported mutable globals for rolling
+// back the state of that same instance, it cannot be restored into another
+// one. Globals that are not exported cannot be reached through the C API and
+// keep their current values on restore, so rollback is only exact for modules
+// keeping their state in memory or in exported globals.
+// Stamping new instances out of a snapshot is not supported. A fresh instance
+// holds the initial values of non-exported globals, and the AssemblyScript
+// runtime keeps its allocator and GC state there, so memory copied from an
+// initialized instance would be corrupted by the next allocation. New plugin
+// instances, voice shards and hot-swapped instances still run the full
+// initialization; the compiled module is what they share, see WasmEngine.
+
+struct WasmSnapshot
+{
+    typedef std::vector<std::pair<std::string, WasmValue>> GlobalVector;
+
+    uint64_t            instanceId;
+    std::vector<byte_t> memory;
+    GlobalVector        globals;
+};
+
+// Maps C++ primitive types to Wasm values for WasmRuntime::call()
+
+template<typename T> struct WasmType;
+
+template<> struct WasmType<int32_t>
+{
+    static const enum wasm_valkind_enum kind = WASM_I32;
+    static WasmValue make(int32_t x) { return MakeI32(x); }
+    static int32_t   get(const WasmValue& v) { return v.of.i32; }
+};
+
+template<> struct WasmType<uint32_t>
+{
+    static const enum wasm_valkind_enum kind = WASM_I32;
+    static WasmValue make(uint32_t x) { return MakeI32(x); }
+    static uint32_t  get(const WasmValue& v) { return static_cast<uint32_t>(v.of.i32); }
+};
+
+template<> struct WasmType<bool>
+{
+    static const enum wasm_valkind_enum kind = WASM_I32;
+    static WasmValue make(bool x) { return MakeI32(x); }
+    static bool      get(const WasmValue& v) { return v.of.i32 != 0; }
+};
+
+template<> struct WasmType<int64_t>
+{
+    static const enum wasm_valkind_enum kind = WASM_I64;
+    static WasmValue make(int64_t x) { return MakeI64(x); }
+    static int64_t   get(const WasmValue& v) { return v.of.i64; }
+};
+
+template<> struct WasmType<float>
+{
+    static const enum wasm_valkind_enum kind = WASM_F32;
+    static WasmValue make(float x) { return MakeF32(x); }
+    static float     get(const WasmValue& v) { return v.of.f32; }
+};
+
+template<> struct WasmType<double>
+{
+    static const enum wasm_valkind_enum kind = WASM_F64;
+    static WasmValue make(double x) { return MakeF64(x); }
+    static double    get(const WasmValue& v) { return v.of.f64; }
+};
+
+template<> struct WasmType<void>
 {
-    WasmValueKindVector params;
-    WasmValueKindVector result;
-    WasmFunction        function;
+    static void get(const WasmValue&) {}
+};
+
+// Trampolines for host imports with primitive signatures. The member function
+// is a template argument so each import gets its own callback, arguments are
+// converted straight from the runtime value array and calls never allocate.
+
+template<std::size_t... I> struct WasmIndices {};
+
+template<std::size_t N, std::size_t... I>
+struct WasmMakeIndices : WasmMakeIndices<N - 1, N - 1, I...> {};
+
+template<std::size_t... I>
+struct WasmMakeIndices<0, I...>
+{
+    typedef WasmIndices<I...> type;
+};
+
+template<typename C, typename R, typename... A>
+struct WasmHostInvoker
+{
+    template<typename M, std::size_t... I>
+    static void invoke(C* obj, M method, const WasmValue* params, WasmValue* result, WasmIndices<I...>)
+    {
+        (void)params;
+        result[0] = WasmType<R>::make((obj->*method)(WasmType<A>::get(params[I])...));
+    }
+
+    static WasmValueKindVector resultKinds() { return { WasmType<R>::kind }; }
+};
+
+template<typename C, typename... A>
+struct WasmHostInvoker<C, void, A...>
+{
+    template<typename M, std::size_t... I>
+    static void invoke(C* obj, M method, const WasmValue* params, WasmValue*, WasmIndices<I...>)
+    {
+        (void)params;
+        (obj->*method)(WasmType<A>::get(params[I])...);
+    }
+
+    static WasmValueKindVector resultKinds() { return {}; }
+};
+
+template<typename F, F f> struct WasmHostMethod;
+
+template<typename C, typename R, typename... A, R (C::*M)(A...)>
+struct WasmHostMethod<R (C::*)(A...), M>
+{
+    typedef WasmHostInvoker<C, R, A...> Invoker;
+
+    static wasm_trap_t* callback(void* env, const wasm_val_vec_t* paramsVec, wasm_val_vec_t* resultVec)
+    {
+        Invoker::invoke(static_cast<C*>(env), M, paramsVec->data, resultVec->data,
+                        typename WasmMakeIndices<sizeof...(A)>::type());
+        return nullptr;
+    }
+
+    static WasmHostFunction bind(C* obj)
+    {
+        return { { WasmType<A>::kind... }, Invoker::resultKinds(), callback, obj };
+    }
+};
+
+template<typename C, typename R, typename... A, R (C::*M)(A...) const>
+struct WasmHostMethod<R (C::*)(A...) const, M>
+{
+    typedef WasmHostInvoker<const C, R, A...> Invoker;
+
+    static wasm_trap_t* callback(void* env, const wasm_val_vec_t* paramsVec, wasm_val_vec_t* resultVec)
+    {
+        Invoker::invoke(static_cast<const C*>(env), M, paramsVec->data, resultVec->data,
+                        typename WasmMakeIndices<sizeof...(A)>::type());
+        return nullptr;
+    }
+
+    static WasmHostFunction bind(const C* obj)
+    {
+        return { { WasmType<A>::kind... }, Invoker::resultKinds(), callback, const_cast<C*>(obj) };
+    }
 };
 
 class WasmRuntime
@@ -68,44 +237,109 @@ public:
 
     void load(const char* modulePath);
     void load(const unsigned char* moduleData, size_t size);
+    void load(const WasmRuntime& other); // share module, no compilation
 
     bool hasInstance();
-    void createInstance(WasmFunctionMap hostFunctions);
+    bool isSimdSupported();
+    const char* getModeName();
+    void createInstance(const WasmHostFunctionMap& hostFunctions);
+
+    WasmFunctionHandle getFunctionHandle(const char* name);
+    WasmGlobalHandle   getGlobalHandle(const char* name);
+    WasmMemoryHandle   getMemoryHandle();
+
+    // Memory base is cached and refreshed after each call into the module, it
+    // only changes when the module grows its memory. Host functions that read
+    // memory while the module is running should call updateMemory() first.
+    void     reserveMemory(uint32_t pages);
+    bool     updateMemory();
+    uint32_t getMemoryPages() const noexcept { return fMemoryPages; }
+    uint32_t getMemoryGrowCount() const noexcept { return fMemoryGrowCount; }
+
+    std::shared_ptr<const WasmSnapshot> takeSnapshot();
+    void restoreSnapshot(const WasmSnapshot& snapshot);
+
+#if defined(HIPHOP_WASM_FUEL_PER_FRAME)
+    // Calls trap once the instance has executed more operators than allowed
+    // by the remaining fuel. Fuel is not refilled automatically.
+    void setFuel(uint64_t fuel);
+    bool isFuelExhausted();
+#endif
 
     byte_t* getMemory(const WasmValue& wPtr = MakeI32(0));
     char*   getMemoryAsCString(const WasmValue& wPtr);
     void    copyCStringToMemory(const WasmValue& wPtr, const char* s);
 
     WasmValue getGlobal(const char* name);
+    WasmValue getGlobal(WasmGlobalHandle global);
     void      setGlobal(const char* name, const WasmValue& value);
+    void      setGlobal(WasmGlobalHandle global, const WasmValue& value);
     char*     getGlobalAsCString(const char* name);
 
     WasmValueVector callFunction(const char* name, WasmValueVector params = {});
+    WasmValueVector callFunction(WasmFunctionHandle function, WasmValueVector params = {});
     WasmValue       callFunctionReturnSingleValue(const char* name, WasmValueVector params = {});
+    WasmValue       callFunctionReturnSingleValue(WasmFunctionHandle function, WasmValueVector params = {});
     const char*     callFunctionReturnCString(const char* name, WasmValueVector params = {});
 
+    // Fixed arity alternative to callFunction() suitable for the audio thread,
+    // arguments and result live on the stack. Example: call<float>(f, 1, 2.f)
+    template<typename R = void, typename... A>
+    R call(WasmFunctionHandle function, A... args)
+    {
+        wasm_val_t params[] = { WasmType<A>::make(args)..., WASM_INIT_VAL };
+        wasm_val_vec_t paramsVec = WASM_ARRAY_VEC(params);
+        paramsVec.size = sizeof...(A);
+#if defined(HIPHOP_WASM_RUNTIME_WAMR)
+        paramsVec.num_elems = sizeof...(A);
+#endif
+        wasm_val_t result[1] = { WASM_INIT_VAL };
+        wasm_val_vec_t resultVec = WASM_ARRAY_VEC(result);
+
+        own wasm_trap_t* trap = fLib.wasm_func_call(function, &paramsVec, &resultVec);
+
+        // Also after a trap, the module might have grown memory before it
+        updateMemory();
+
+        if (trap != nullptr) {
+            throwTrap(trap, function);
+        }
+
+        return WasmType<R>::get(result[0]);
+    }
+
 private:
     void destroyInstance();
 
-    static wasm_trap_t* callHostFunction(void *env, const wasm_val_vec_t* paramsVec, wasm_val_vec_t* resultVec);
+    wasm_extern_t* findExport(const char* name);
+    const char*    findExportName(const void* handle);
+
+    [[noreturn]] void throwTrap(own wasm_trap_t* trap, WasmFunctionHandle function);
 
     // - an exception are `own` pointer parameters named `out`, which are copy-back
     //   output parameters passing back ownership from callee to caller
     void toCValueTypeVector(WasmValueKindVector kinds, own wasm_valtype_vec_t* out);
        
+    static const char* detectModeName(const unsigned char* moduleData, size_t size);
+
     const char* WTF16ToCString(const WasmValue& wPtr);
     WasmValue   CToWTF16String(const char* s);
 
-    WasmCApi           fLib;
-    wasm_engine_t*     fEngine;
-    wasm_store_t*      fStore;
-    wasm_module_t*     fModule;
-    wasm_instance_t*   fInstance;
-    wasm_extern_vec_t  fExportsVec;
-    WasmFunctionVector fHostFunctions;
-    WasmExternMap      fModuleExports;
+    WasmCApi                    fLib;
+    std::shared_ptr<WasmEngine> fEngine;
+    wasm_store_t*               fStore;
+    std::shared_ptr<WasmModule> fModule;
+    const char*                 fModeName;
+    wasm_instance_t*            fInstance;
+    uint64_t                    fInstanceId;
+    wasm_extern_vec_t           fExportsVec;
+    WasmExternMap               fModuleExports;
+    WasmMemoryHandle            fMemory;
+    byte_t*                     fMemoryData;
+    uint32_t                    fMemoryPages;
+    uint32_t                    fMemoryGrowCount;
 #if HIPHOP_PLUGIN_WASM_WASI
-    wasi_env_t*        fWasiEnv;
+    wasi_env_t*                 fWasiEnv;
 #endif
 
     DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WasmRuntime)
@@ -0,0 +1,239 @@
+/*
+ * Hip-Hop / High Performance Hybrid Audio Plugins
+ * Copyright (C) 2021-2022 Luciano Iam <oss@lucianoiam.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORKER_POOL_HPP
+#define WORKER_POOL_HPP
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+# include <immintrin.h>
+#endif
+
+#include "src/DistrhoDefines.h"
+#include "distrho/extra/LeakDetector.hpp"
+#include "distrho/extra/Thread.hpp"
+
+#include "Semaphore.hpp"
+
+START_NAMESPACE_DISTRHO
+
+// Runs a batch of tasks on the calling thread plus a set of real-time worker
+// threads and returns once all of them completed. Tasks are split into equal
+// ranges, one per thread, threads that finish their own range steal remaining
+// tasks from the others. run() neither allocates nor locks, sleeping workers
+// are woken through a semaphore that only enters the kernel when a worker is
+// actually waiting. Idle workers keep polling for a new cycle during spinUs
+// microseconds before going to sleep, 0 sleeps right away. Task functions
+// must not throw.
+
+class WorkerPool
+{
+public:
+    typedef void (*TaskFunction)(void* context, uint32_t task);
+
+    // Thread count includes the thread calling run()
+    WorkerPool(uint32_t threadCount, uint32_t spinUs, TaskFunction function, void* context)
+        : fFunction(function)
+        , fContext(context)
+        , fRanges(new Range[threadCount > 0 ? threadCount : 1])
+        , fThreadCount(threadCount > 0 ? threadCount : 1)
+        , fSpinTime(spinUs)
+        , fCycle(0)
+        , fRemaining(0)
+    {
+        for (uint32_t i = 0; i < fThreadCount; i++) {
+            fRanges[i].state = 0;
+        }
+
+        for (uint32_t i = 1; i < fThreadCount; i++) {
+            fWorkers.push_back(std::unique_ptr<Worker>(new Worker(this, i)));
+            fWorkers.back()->startThread(true);
+        }
+    }
+
+    ~WorkerPool()
+    {
+        for (size_t i = 0; i < fWorkers.size(); i++) {
+            fWorkers[i]->stop();
+        }
+    }
+
+    uint32_t getThreadCount() const noexcept
+    {
+        return fThreadCount;
+    }
+
+    void run(uint32_t taskCount) noexcept
+    {
+        if ((fThreadCount == 1) || (taskCount < 2)) {
+            for (uint32_t i = 0; i < taskCount; i++) {
+                fFunction(fContext, i);
+            }
+
+            return;
+        }
+
+        // Remaining count is published before the ranges, a worker running
+        // late from the previous cycle can only claim tasks of this one
+        fRemaining.store(taskCount, std::memory_order_relaxed);
+
+        for (uint32_t i = 0; i < fThreadCount; i++) {
+            const uint64_t start = static_cast<uint64_t>(taskCount) * i / fThreadCount;
+            const uint64_t end = static_cast<uint64_t>(taskCount) * (i + 1) / fThreadCount;
+            fRanges[i].state.store((end << 32) | start, std::memory_order_release);
+        }
+
+        fCycle.fetch_add(1, std::memory_order_seq_cst);
+
+        // Only sleeping workers are signaled, spinning ones see the new cycle.
+        // Either way the calling thread steals tasks nobody picked up.
+        for (size_t i = 0; i < fWorkers.size(); i++) {
+            fWorkers[i]->wakeUp();
+        }
+
+        runTasks(0);
+
+        while (fRemaining.load(std::memory_order_acquire) != 0) {
+            spinPause();
+        }
+    }
+
+private:
+    // Packed as end << 32 | next so a claim is a single compare-and-swap
+    struct Range
+    {
+        std::atomic<uint64_t> state;
+        char                  padding[64 - sizeof(std::atomic<uint64_t>)]; // avoid false sharing
+    };
+
+    class Worker : public Thread
+    {
+    public:
+        Worker(WorkerPool* pool, uint32_t index)
+            : Thread("wasm_worker")
+            , fPool(pool)
+            , fIndex(index)
+            , fSleeping(false)
+        {}
+
+        void wakeUp() noexcept
+        {
+            if (fSleeping.exchange(false, std::memory_order_seq_cst)) {
+                fSemaphore.post();
+            }
+        }
+
+        void stop()
+        {
+            signalThreadShouldExit();
+            fSleeping = false;
+            fSemaphore.post();
+            stopThread(-1);
+        }
+
+    protected:
+        void run() override
+        {
+            uint32_t cycle = fPool->fCycle.load(std::memory_order_acquire);
+
+            while (! shouldThreadExit()) {
+                const std::chrono::steady_clock::time_point spinEnd =
+                    std::chrono::steady_clock::now() + fPool->fSpinTime;
+
+                while ((fPool->fCycle.load(std::memory_order_acquire) == cycle)
+                        && (std::chrono::steady_clock::now() < spinEnd)) {
+                    spinPause();
+                }
+
+                if (fPool->fCycle.load(std::memory_order_acquire) == cycle) {
+                    // Checked again after raising the flag so a cycle started
+                    // in between is not missed, a stale post only costs one
+                    // extra pass
+                    fSleeping.store(true, std::memory_order_seq_cst);
+
+                    if ((fPool->fCycle.load(std::memory_order_seq_cst) == cycle) && ! shouldThreadExit()) {
+                        fSemaphore.wait();
+                    }
+
+                    fSleeping.store(false, std::memory_order_relaxed);
+                    continue;
+                }
+
+                cycle = fPool->fCycle.load(std::memory_order_acquire);
+                fPool->runTasks(fIndex);
+            }
+        }
+
+    private:
+        WorkerPool*       fPool;
+        uint32_t          fIndex;
+        std::atomic<bool> fSleeping;
+        Semaphore         fSemaphore;
+
+    };
+
+    // Tells the CPU this is a spin-wait loop, saves power and lets a sibling
+    // hyper-thread run
+    static void spinPause() noexcept
+    {
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+        _mm_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+        __asm__ __volatile__("yield");
+#endif
+    }
+
+    void runTasks(uint32_t thread) noexcept
+    {
+        for (uint32_t i = 0; i < fThreadCount; i++) {
+            std::atomic<uint64_t>& state = fRanges[(thread + i) % fThreadCount].state;
+            uint64_t value = state.load(std::memory_order_acquire);
+
+            while ((value & 0xffffffff) < (value >> 32)) {
+                if (! state.compare_exchange_weak(value, value + 1, std::memory_order_acq_rel)) {
+                    continue; // value was reloaded
+                }
+
+                fFunction(fContext, static_cast<uint32_t>(value & 0xffffffff));
+                fRemaining.fetch_sub(1, std::memory_order_acq_rel);
+                value = state.load(std::memory_order_acquire);
+            }
+        }
+    }
+
+    TaskFunction                         fFunction;
+    void*                                fContext;
+    std::unique_ptr<Range[]>             fRanges;
+    uint32_t                             fThreadCount;
+    std::chrono::microseconds            fSpinTime;
+    std::vector<std::unique_ptr<Worker>> fWorkers;
+    std::atomic<uint32_t>                fCycle;
+    std::atomic<uint32_t>                fRemaining;
+
+    DISTRHO_DECLARE_NON_COPYABLE_WITH_LEAK_DETECTOR(WorkerPool)
+
+};
+
+END_NAMESPACE_DISTRHO
+
+#endif  // WORKER_POOL_HPP
@@ -19,7 +19,7 @@
 // This file attempts to mimic the C++ public plugin interfaces. Low level
 // interactions with the host are strictly confined to index.ts .
 
-import { _get_samplerate, _get_time_position, _write_midi_event } from './index'
+import { _get_samplerate, _get_time_position, _write_midi_event, _get_parameter_events } from './index'
 
 export default namespace DISTRHO {
 
@@ -82,6 +82,23 @@ export default namespace DISTRHO {
     }
 
     export class Plugin {
+
+        // Not found in C++ DPF. When set to true parameter changes are not
+        // delivered through setParameterValue() but as a list of events timed
+        // within the current block, see getParameterEvents()
+        sampleAccurateParameters: bool = false
+
+        // Not found in C++ DPF. When set to true outputs share memory with the
+        // inputs, run() must read each input sample before overwriting it.
+        // Ignored when there are more outputs than inputs.
+        inPlaceProcessing: bool = false
+
+        // Not found in C++ DPF. When set to true the output must be the sum of
+        // independent voices started by notes. Builds with voice workers then
+        // run several instances of the plugin in parallel, each one receiving
+        // a share of the notes and all other events, and mix their outputs.
+        // Audio not produced by voices would be repeated once per instance.
+        voiceSharding: bool = false
         
         // double Plugin::getSampleRate()
         getSampleRate(): f32 {
@@ -89,15 +106,23 @@ export default namespace DISTRHO {
         }
 
         // const TimePosition& Plugin::getTimePosition()
+        // The returned object is reused, only valid during run()
         getTimePosition(): TimePosition {
             return _get_time_position()
         }
 
         // bool writeMidiEvent(const MidiEvent& midiEvent)
+        // Events are sent to the host after run() returns
         writeMidiEvent(midiEvent: MidiEvent): bool {
             return _write_midi_event(midiEvent)
         }
 
+        // Not found in C++ DPF. Parameter changes for the current run() call
+        // sorted by frame, only valid during run()
+        getParameterEvents(): ParameterEvent[] {
+            return _get_parameter_events()
+        }
+
     }
 
     // struct DISTRHO::Parameter
@@ -130,6 +155,9 @@ export default namespace DISTRHO {
     }
 
     // struct DISTRHO::MidiEvent
+    // Events passed to run() are reused by the framework, copy them if needed
+    // after run() returns. Large SysEx messages may be split across several
+    // run() calls, continuation chunks do not start with F0.
     export class MidiEvent {
 
         static readonly kDataSize: u32 = 4
@@ -139,11 +167,36 @@ export default namespace DISTRHO {
 
     }
 
+    // Not found in C++ DPF, see Plugin.getParameterEvents()
+    export class ParameterEvent {
+
+        frame: u32
+        index: u32
+        value: f32
+
+    }
+
     // struct DISTRHO::TimePosition
     export class TimePosition {
 
         playing: bool
         frame: u64
+        bbt: BarBeatTick = new BarBeatTick
+
+    }
+
+    // struct DISTRHO::TimePosition::BarBeatTick
+    export class BarBeatTick {
+
+        valid: bool
+        bar: i32
+        beat: i32
+        tick: f64
+        barStartTick: f64
+        beatsPerBar: f32
+        beatType: f32
+        ticksPerBeat: f64
+        beatsPerMinute: f64
 
     }
 
@@ -183,4 +236,265 @@ export default namespace DISTRHO {
 
     }
 
+    // Not found in C++ DPF. Block processing helpers, these use 128-bit Wasm
+    // SIMD when the module is built with SIMD enabled (HIPHOP_WASM_SIMD) and
+    // equivalent scalar code otherwise. Functions process the first frames
+    // samples of each array.
+
+    export namespace DSP {
+
+        const PI: f32 = 3.14159265
+        const HALF_PI: f32 = 1.57079633
+        const TWO_PI: f32 = 6.28318531
+        const INV_TWO_PI: f32 = 0.159154943
+        const LOG2_E: f32 = 1.44269504
+
+        // Taylor series for sin(x) in [-pi/2, pi/2]
+        const SIN_3: f32 = -1.66666667e-1
+        const SIN_5: f32 = 8.33333333e-3
+        const SIN_7: f32 = -1.98412698e-4
+        const SIN_9: f32 = 2.75573192e-6
+
+        // Taylor series for 2^x in [0, 1)
+        const EXP2_1: f32 = 6.93147181e-1
+        const EXP2_2: f32 = 2.40226507e-1
+        const EXP2_3: f32 = 5.55041087e-2
+        const EXP2_4: f32 = 9.61812911e-3
+        const EXP2_5: f32 = 1.33335581e-3
+        const EXP2_6: f32 = 1.54035304e-4
+
+        // buffer[i] *= factor
+        export function gain(buffer: Float32Array, frames: i32, factor: f32): void {
+            let i = 0
+
+            if (ASC_FEATURE_SIMD) {
+                const ptr = buffer.dataStart
+                const g = f32x4.splat(factor)
+
+                for (; i + 4 <= frames; i += 4) {
+                    const p = ptr + (<usize>i << 2)
+                    v128.store(p, f32x4.mul(v128.load(p), g))
+                }
+            }
+
+            for (; i < frames; ++i) {
+                buffer[i] *= factor
+            }
+        }
+
+        // output[i] += gain * input[i]
+        export function mix(output: Float32Array, input: Float32Array, frames: i32, gain: f32): void {
+            let i = 0
+
+            if (ASC_FEATURE_SIMD) {
+                const dst = output.dataStart
+                const src = input.dataStart
+                const g = f32x4.splat(gain)
+
+                for (; i + 4 <= frames; i += 4) {
+                    const offset = <usize>i << 2
+                    const x = f32x4.mul(v128.load(src + offset), g)
+                    v128.store(dst + offset, f32x4.add(v128.load(dst + offset), x))
+                }
+            }
+
+            for (; i < frames; ++i) {
+                output[i] += gain * input[i]
+            }
+        }
+
+        // output[i] = sin(input[i]), absolute error below 1e-5. Arrays can be
+        // the same.
+        export function sin(output: Float32Array, input: Float32Array, frames: i32): void {
+            let i = 0
+
+            if (ASC_FEATURE_SIMD) {
+                const dst = output.dataStart
+                const src = input.dataStart
+
+                for (; i + 4 <= frames; i += 4) {
+                    const offset = <usize>i << 2
+                    let x = v128.load(src + offset)
+
+                    // Reduce to [-pi, pi] and then reflect into [-pi/2, pi/2]
+                    x = f32x4.sub(x, f32x4.mul(f32x4.splat(TWO_PI),
+                                  f32x4.nearest(f32x4.mul(x, f32x4.splat(INV_TWO_PI)))))
+                    x = v128.bitselect(f32x4.sub(f32x4.splat(PI), x), x,
+                                       f32x4.gt(x, f32x4.splat(HALF_PI)))
+                    x = v128.bitselect(f32x4.sub(f32x4.splat(-PI), x), x,
+                                       f32x4.lt(x, f32x4.splat(-HALF_PI)))
+
+                    const x2 = f32x4.mul(x, x)
+                    let p = f32x4.add(f32x4.splat(SIN_7), f32x4.mul(x2, f32x4.splat(SIN_9)))
+                    p = f32x4.add(f32x4.splat(SIN_5), f32x4.mul(x2, p))
+                    p = f32x4.add(f32x4.splat(SIN_3), f32x4.mul(x2, p))
+                    p = f32x4.add(f32x4.splat(1), f32x4.mul(x2, p))
+
+                    v128.store(dst + offset, f32x4.mul(x, p))
+                }
+            }
+
+            for (; i < frames; ++i) {
+                output[i] = sinApprox(input[i])
+            }
+        }
+
+        // output[i] = exp(input[i]), relative error below 1e-5 for results in
+        // the normal f32 range. Arrays can be the same.
+        export function exp(output: Float32Array, input: Float32Array, frames: i32): void {
+            let i = 0
+
+            if (ASC_FEATURE_SIMD) {
+                const dst = output.dataStart
+                const src = input.dataStart
+
+                for (; i + 4 <= frames; i += 4) {
+                    const offset = <usize>i << 2
+
+                    // exp(x) = 2^t = 2^n * 2^f, n = floor(t), f in [0, 1)
+                    let t = f32x4.mul(v128.load(src + offset), f32x4.splat(LOG2_E))
+                    t = f32x4.max(f32x4.splat(-126), f32x4.min(f32x4.splat(127), t))
+                    const n = f32x4.floor(t)
+                    const f = f32x4.sub(t, n)
+
+                    let p = f32x4.add(f32x4.splat(EXP2_5), f32x4.mul(f, f32x4.splat(EXP2_6)))
+                    p = f32x4.add(f32x4.splat(EXP2_4), f32x4.mul(f, p))
+                    p = f32x4.add(f32x4.splat(EXP2_3), f32x4.mul(f, p))
+                    p = f32x4.add(f32x4.splat(EXP2_2), f32x4.mul(f, p))
+                    p = f32x4.add(f32x4.splat(EXP2_1), f32x4.mul(f, p))
+                    p = f32x4.add(f32x4.splat(1), f32x4.mul(f, p))
+
+                    // Build 2^n from its exponent bits
+                    const e = i32x4.shl(i32x4.add(i32x4.trunc_sat_f32x4_s(n), i32x4.splat(127)), 23)
+
+                    v128.store(dst + offset, f32x4.mul(p, e))
+                }
+            }
+
+            for (; i < frames; ++i) {
+                output[i] = expApprox(input[i])
+            }
+        }
+
+        // Second order IIR filter in transposed direct form II. Up to 4 channels
+        // sharing the same coefficients are filtered in parallel, one per SIMD
+        // lane. Coefficients are normalized so that a0 = 1.
+        export class Biquad {
+
+            b0: f32 = 1
+            b1: f32 = 0
+            b2: f32 = 0
+            a1: f32 = 0
+            a2: f32 = 0
+
+            // Filter state, one element per channel
+            private z1: StaticArray<f32> = new StaticArray<f32>(4)
+            private z2: StaticArray<f32> = new StaticArray<f32>(4)
+
+            setCoefficients(b0: f32, b1: f32, b2: f32, a1: f32, a2: f32): void {
+                this.b0 = b0
+                this.b1 = b1
+                this.b2 = b2
+                this.a1 = a1
+                this.a2 = a2
+            }
+
+            reset(): void {
+                for (let c = 0; c < 4; ++c) {
+                    this.z1[c] = 0
+                    this.z2[c] = 0
+                }
+            }
+
+            // Filters channels in place, only the first 4 channels are processed
+            process(channels: Float32Array[], frames: i32): void {
+                const count = min(channels.length, 4)
+
+                if (count == 0) {
+                    return
+                }
+
+                if (ASC_FEATURE_SIMD) {
+                    // Unused lanes read channel 0 and their results are dropped
+                    const ch0 = channels[0]
+                    const ch1 = count > 1 ? channels[1] : ch0
+                    const ch2 = count > 2 ? channels[2] : ch0
+                    const ch3 = count > 3 ? channels[3] : ch0
+
+                    const b0 = f32x4.splat(this.b0)
+                    const b1 = f32x4.splat(this.b1)
+                    const b2 = f32x4.splat(this.b2)
+                    const a1 = f32x4.splat(this.a1)
+                    const a2 = f32x4.splat(this.a2)
+
+                    let z1 = v128.load(changetype<usize>(this.z1))
+                    let z2 = v128.load(changetype<usize>(this.z2))
+
+                    for (let i = 0; i < frames; ++i) {
+                        let x = f32x4.splat(ch0[i])
+                        x = f32x4.replace_lane(x, 1, ch1[i])
+                        x = f32x4.replace_lane(x, 2, ch2[i])
+                        x = f32x4.replace_lane(x, 3, ch3[i])
+
+                        const y = f32x4.add(f32x4.mul(b0, x), z1)
+                        z1 = f32x4.add(f32x4.sub(f32x4.mul(b1, x), f32x4.mul(a1, y)), z2)
+                        z2 = f32x4.sub(f32x4.mul(b2, x), f32x4.mul(a2, y))
+
+                        ch0[i] = f32x4.extract_lane(y, 0)
+                        if (count > 1) ch1[i] = f32x4.extract_lane(y, 1)
+                        if (count > 2) ch2[i] = f32x4.extract_lane(y, 2)
+                        if (count > 3) ch3[i] = f32x4.extract_lane(y, 3)
+                    }
+
+                    v128.store(changetype<usize>(this.z1), z1)
+                    v128.store(changetype<usize>(this.z2), z2)
+
+                    return
+                }
+
+                for (let c = 0; c < count; ++c) {
+                    const ch = channels[c]
+                    let z1 = this.z1[c]
+                    let z2 = this.z2[c]
+
+                    for (let i = 0; i < frames; ++i) {
+                        const x = ch[i]
+                        const y = this.b0 * x + z1
+                        z1 = this.b1 * x - this.a1 * y + z2
+                        z2 = this.b2 * x - this.a2 * y
+                        ch[i] = y
+                    }
+
+                    this.z1[c] = z1
+                    this.z2[c] = z2
+                }
+            }
+
+        }
+
+        function sinApprox(x: f32): f32 {
+            x -= TWO_PI * Mathf.nearest(x * INV_TWO_PI)
+
+            if (x > HALF_PI) {
+                x = PI - x
+            } else if (x < -HALF_PI) {
+                x = -PI - x
+            }
+
+            const x2 = x * x
+
+            return x * (1 + x2 * (SIN_3 + x2 * (SIN_5 + x2 * (SIN_7 + x2 * SIN_9))))
+        }
+
+        function expApprox(x: f32): f32 {
+            const t = max<f32>(-126, min<f32>(127, x * LOG2_E))
+            const n = Mathf.floor(t)
+            const f = t - n
+            const p = 1 + f * (EXP2_1 + f * (EXP2_2 + f * (EXP2_3 + f * (EXP2_4 + f * (EXP2_5 + f * EXP2_6)))))
+
+            return p * reinterpret<f32>((<i32>n + 127) << 23)
+        }
+
+    }
+
 }
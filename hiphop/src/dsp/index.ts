@@ -35,32 +35,58 @@ const pluginInstance = new PluginImpl
 // in the module imports table.
 
 declare function get_samplerate(): f32
-declare function get_time_position(): void
-declare function write_midi_event(): bool
 
 // Host functions dealing with primitives can be simply re-exported, functions
 // dealing with complex types need translation. Hide complexity from dpf.ts .
 
 export { get_samplerate as _get_samplerate }
 
+// Output events are appended to _rw_midi_out_block and the host sends them all
+// after run() returns, instead of calling into the host once per event. Returns
+// false when the block is full, the host counts such events as dropped.
+
 export function _write_midi_event(midiEvent: DISTRHO.MidiEvent): bool {
-    let midiOffset: i32 = 0
-    raw_midi_events.setUint32(midiOffset, midiEvent.frame, /*LE*/true)
+    const size = midiEvent.data.length
+    let midiOffset = _rw_midi_out_bytes
+
+    if (midiOffset + 8 + size > MAX_MIDI_OUT_BYTES) {
+        _rw_midi_out_dropped++
+        return false
+    }
+
+    raw_midi_out_events.setUint32(midiOffset, midiEvent.frame, /*LE*/true)
     midiOffset += 4
-    raw_midi_events.setUint32(midiOffset, midiEvent.data.length, /*LE*/true)
+    raw_midi_out_events.setUint32(midiOffset, size, /*LE*/true)
     midiOffset += 4
-    for (let i = 0; i < midiEvent.data.length; ++i) {
-        raw_midi_events.setUint8(midiOffset, midiEvent.data[i])
-        midiOffset++
-    }
-    return write_midi_event()
+    memory.copy(changetype<usize>(_rw_midi_out_block) + <usize>midiOffset,
+                midiEvent.data.dataStart, <usize>size)
+    _rw_midi_out_bytes = midiOffset + size
+
+    return true
 }
 
+export function _get_parameter_events(): DISTRHO.ParameterEvent[] {
+    return parameterEvents
+}
+
+// The host writes the transport state into _rw_time_block before every run()
+// call, reading it does not leave the VM. Decoded into a single object that is
+// reused across calls.
+
 export function _get_time_position(): DISTRHO.TimePosition {
-    get_time_position()
-    let pos = new DISTRHO.TimePosition
-    pos.playing = <bool>_rw_int32_0
-    pos.frame = _rw_int64_0
+    const pos = timePosition
+    const bbt = pos.bbt
+    pos.playing = raw_time_position.getUint32(0, /*LE*/true) != 0
+    bbt.valid = raw_time_position.getUint32(4, /*LE*/true) != 0
+    pos.frame = raw_time_position.getUint64(8, /*LE*/true)
+    bbt.bar = raw_time_position.getInt32(16, /*LE*/true)
+    bbt.beat = raw_time_position.getInt32(20, /*LE*/true)
+    bbt.tick = raw_time_position.getFloat64(24, /*LE*/true)
+    bbt.barStartTick = raw_time_position.getFloat64(32, /*LE*/true)
+    bbt.beatsPerBar = raw_time_position.getFloat32(40, /*LE*/true)
+    bbt.beatType = raw_time_position.getFloat32(44, /*LE*/true)
+    bbt.ticksPerBeat = raw_time_position.getFloat64(48, /*LE*/true)
+    bbt.beatsPerMinute = raw_time_position.getFloat64(56, /*LE*/true)
     return pos
 }
 
@@ -91,17 +117,95 @@ export function get_unique_id(): i64 {
     return pluginInstance.getUniqueId()
 }
 
-// See explanation below for the odd value return convention
-    
-export function init_parameter(index: u32): void {
-    const parameter = new DISTRHO.Parameter
-    pluginInstance.initParameter(index, parameter)
+export function get_voice_sharding(): bool {
+    return pluginInstance.voiceSharding
+}
+
+// Descriptors for all parameters, programs and states are returned by a single
+// call to avoid one VM round trip per index and field when the host scans the
+// plugin. Integers are LE u32, strings are UTF-8 prefixed by their byte length.
+//   header:     total byte size, parameter count, program count, state count
+//   parameters: hints, default (f32), min (f32), max (f32), name
+//   programs:   name
+//   states:     hints, key, default value, label, description
+
+export function get_descriptors(parameterCount: u32, programCount: u32, stateCount: u32): ArrayBuffer {
+    let size: i32 = 16
+    let strings: ArrayBuffer[] = []
+
+    let parameters: DISTRHO.Parameter[] = []
+
+    for (let i: u32 = 0; i < parameterCount; ++i) {
+        const parameter = new DISTRHO.Parameter
+        pluginInstance.initParameter(i, parameter)
+        parameters.push(parameter)
+        strings.push(String.UTF8.encode(parameter.name))
+    }
+
+    for (let i: u32 = 0; i < programCount; ++i) {
+        let programName = new DISTRHO.String
+        pluginInstance.initProgramName(i, programName)
+        strings.push(String.UTF8.encode(programName.value))
+    }
+
+    let states: DISTRHO.State[] = []
+
+    for (let i: u32 = 0; i < stateCount; ++i) {
+        const state = new DISTRHO.State
+        pluginInstance.initState(i, state)
+        states.push(state)
+        strings.push(String.UTF8.encode(state.key))
+        strings.push(String.UTF8.encode(state.defaultValue))
+        strings.push(String.UTF8.encode(state.label))
+        strings.push(String.UTF8.encode(state.description))
+    }
+
+    size += 16 * parameterCount + 4 * stateCount
+
+    for (let i = 0; i < strings.length; ++i) {
+        size += 4 + strings[i].byteLength
+    }
+
+    const buffer = new ArrayBuffer(size)
+    const view = new DataView(buffer)
+    let offset: i32 = 0
+    let stringIndex: i32 = 0
+
+    view.setUint32(offset, size, /*LE*/true)
+    view.setUint32(offset + 4, parameterCount, /*LE*/true)
+    view.setUint32(offset + 8, programCount, /*LE*/true)
+    view.setUint32(offset + 12, stateCount, /*LE*/true)
+    offset += 16
+
+    for (let i: u32 = 0; i < parameterCount; ++i) {
+        const parameter = parameters[i]
+        view.setUint32(offset, parameter.hints, /*LE*/true)
+        view.setFloat32(offset + 4, parameter.ranges.def, /*LE*/true)
+        view.setFloat32(offset + 8, parameter.ranges.min, /*LE*/true)
+        view.setFloat32(offset + 12, parameter.ranges.max, /*LE*/true)
+        offset = write_descriptor_string(view, offset + 16, strings[stringIndex++])
+    }
+
+    for (let i: u32 = 0; i < programCount; ++i) {
+        offset = write_descriptor_string(view, offset, strings[stringIndex++])
+    }
 
-    _rw_int32_0 = parameter.hints
-    _ro_string_0 = wtf16_to_c_string(parameter.name)
-    _rw_float32_0 = parameter.ranges.def
-    _rw_float32_1 = parameter.ranges.min
-    _rw_float32_2 = parameter.ranges.max
+    for (let i: u32 = 0; i < stateCount; ++i) {
+        view.setUint32(offset, states[i].hints, /*LE*/true)
+        offset += 4
+
+        for (let j = 0; j < 4; ++j) {
+            offset = write_descriptor_string(view, offset, strings[stringIndex++])
+        }
+    }
+
+    return buffer
+}
+
+function write_descriptor_string(view: DataView, offset: i32, s: ArrayBuffer): i32 {
+    view.setUint32(offset, s.byteLength, /*LE*/true)
+    memory.copy(changetype<usize>(view.buffer) + offset + 4, changetype<usize>(s), s.byteLength)
+    return offset + 4 + s.byteLength
 }
 
 export function get_parameter_value(index: u32): f32 {
@@ -112,27 +216,10 @@ export function set_parameter_value(index: u32, value: f32): void {
     pluginInstance.setParameterValue(index, value)
 }
 
-export function init_program_name(index: u32): ArrayBuffer {
-    let programName = new DISTRHO.String
-    pluginInstance.initProgramName(index, programName)
-    return wtf16_to_c_string(programName.value)
-}
-
 export function load_program(index: u32): void {
     pluginInstance.loadProgram(index)
 }
 
-export function init_state(index: u32): void {
-    const state = new DISTRHO.State
-    pluginInstance.initState(index, state)
-
-    _rw_int32_0 = state.hints
-    _ro_string_0 = wtf16_to_c_string(state.key)
-    _ro_string_1 = wtf16_to_c_string(state.defaultValue)
-    _ro_string_2 = wtf16_to_c_string(state.label)
-    _ro_string_3 = wtf16_to_c_string(state.description)
-}
-
 export function set_state(key: ArrayBuffer, value: ArrayBuffer): void {
     pluginInstance.setState(c_to_wtf16_string(key), c_to_wtf16_string(value))
 }
@@ -141,47 +228,93 @@ export function get_state(key: ArrayBuffer): ArrayBuffer {
     return wtf16_to_c_string(pluginInstance.getState(c_to_wtf16_string(key)))
 }
 
+// Called by the host once right after instantiation, after setting the _rw_
+// globals. Blocks sized by the host are allocated here so they exist before any
+// other call, including run() on an instance that was never activated.
+
+export function init(): void {
+    create_midi_block()
+}
+
 export function activate(): void {
     pluginInstance.activate()
+
+    // In-place plugins write their outputs over the inputs, the host then reads
+    // back from the input block and a single block stays in cache
+    if (pluginInstance.inPlaceProcessing && (_rw_num_outputs <= _rw_num_inputs)) {
+        _rw_output_block = _rw_input_block
+    } else {
+        _rw_output_block = output_block
+    }
+
+    create_audio_views()
 }
 
 export function deactivate(): void {
     pluginInstance.deactivate()
 }
 
-export function run(frames: u32, midiEventCount: u32): void {
-    let inputs: Float32Array[] = []
-
-    for (let i: i32 = 0; i < _rw_num_inputs; ++i) {
-        inputs.push(Float32Array.wrap(_rw_input_block, i * frames * 4, frames))
+export function run(frames: u32, midiEventCount: u32, paramEventCount: u32): void {
+    // Views are only resized when the host changes the block size
+    if (<u32>audioViewFrames != frames) {
+        resize_audio_views(frames)
     }
 
-    let outputs: Float32Array[] = []
-
-    for (let i: i32 = 0; i < _rw_num_outputs; ++i) {
-        outputs.push(Float32Array.wrap(_rw_output_block, i * frames * 4, frames))
-    }
+    // All objects handed to the plugin are taken from pools allocated at init
+    // time, run() does not allocate so GC work is not part of every block.
 
-    let midiEvents: DISTRHO.MidiEvent[] = []
+    _rw_midi_out_bytes = 0
+    _rw_midi_out_dropped = 0
+    midiEvents.length = 0
     let midiOffset: i32 = 0
     
     for (let i: u32 = 0; i < midiEventCount; ++i) {
-        let event = new DISTRHO.MidiEvent
+        let event = midiEventPool[i]
         event.frame = raw_midi_events.getUint32(midiOffset, /*LE*/ true)
         midiOffset += 4
         let size = raw_midi_events.getUint32(midiOffset, /*LE*/ true)
         midiOffset += 4
-        event.data = Uint8Array.wrap(_rw_midi_block, midiOffset, size)
+        retarget_view(event.data, midiOffset, size)
         midiOffset += size
         midiEvents.push(event)
     }
 
+    // Parameter changes are delivered as a single list per block. Plugins that
+    // handle them with sample accuracy read the list through getParameterEvents()
+    // during run(), otherwise apply them now in order.
+
+    parameterEvents.length = 0
+    let paramOffset: i32 = 0
+
+    for (let i: u32 = 0; i < paramEventCount; ++i) {
+        let event = parameterEventPool[i]
+        event.frame = raw_param_events.getUint32(paramOffset, /*LE*/ true)
+        paramOffset += 4
+        event.index = raw_param_events.getUint32(paramOffset, /*LE*/ true)
+        paramOffset += 4
+        event.value = raw_param_events.getFloat32(paramOffset, /*LE*/ true)
+        paramOffset += 4
+
+        if (pluginInstance.sampleAccurateParameters) {
+            parameterEvents.push(event)
+        } else {
+            pluginInstance.setParameterValue(event.index, event.value)
+        }
+    }
+
     // Count arguments are redundant, they can be inferred from arrays length.
-    pluginInstance.run(inputs, outputs, midiEvents)
+    pluginInstance.run(inputViews, outputViews, midiEvents)
+}
 
-    // Run AS GC on each _run() call for more deterministic memory mgmt.
-    // This can help preventing dropouts when running at small buffer sizes.
-    __collect();
+// Run AS GC, called by the host after each run() call only when the module is
+// built with the minimal runtime (HIPHOP_AS_RUNTIME=minimal), which never
+// collects on its own. The incremental runtime already collects in steps while
+// allocating and the stub runtime never frees, a full collection per block
+// would only add cost. Exported as a separate function so the host can measure
+// its cost.
+
+export function collect(): void {
+    __collect()
 }
 
 // Number of inputs or outputs does not change during runtime so it makes sense
@@ -193,42 +326,143 @@ export let _rw_num_outputs: i32
 // Using exported globals instead of passing buffer arguments to run() allows
 // for a simpler implementation by avoiding Wasm memory alloc on the host side.
 // Audio block size should not exceed 64Kb, or 16384 frames of 32-bit float
-// samples. Midi should not exceed 6Kb, or 512 events of 12 bytes (def. size)
+// samples. The host splits larger buffers into sub-blocks. MAX_AUDIO_BLOCK_BYTES
+// must match the value in WasmPluginImpl.cpp
 
 const MAX_AUDIO_BLOCK_BYTES = 65536
 
 export let _rw_input_block = new ArrayBuffer(MAX_AUDIO_BLOCK_BYTES)
 export let _rw_output_block = new ArrayBuffer(MAX_AUDIO_BLOCK_BYTES)
 
-const MAX_MIDI_EVENT_BYTES = 1536
-
-export let _rw_midi_block = new ArrayBuffer(MAX_MIDI_EVENT_BYTES)
-
-let raw_midi_events = new DataView(_rw_midi_block, 0, MAX_MIDI_EVENT_BYTES)
-
-// AssemblyScript does not support multi-values yet. Export a couple of generic
-// variables for returning complex data types like initParameter() requires.
-
-export let _rw_int32_0: i32
-export let _rw_int32_1: i32
-export let _rw_int32_2: i32
-export let _rw_int32_3: i32
-export let _rw_int64_0: i64
-export let _rw_int64_1: i64
-export let _rw_int64_2: i64
-export let _rw_int64_3: i64
-export let _rw_float32_0: f32
-export let _rw_float32_1: f32
-export let _rw_float32_2: f32
-export let _rw_float32_3: f32
-export let _rw_float64_0: f64
-export let _rw_float64_1: f64
-export let _rw_float64_2: f64
-export let _rw_float64_3: f64
-export let _ro_string_0: ArrayBuffer
-export let _ro_string_1: ArrayBuffer
-export let _ro_string_2: ArrayBuffer
-export let _ro_string_3: ArrayBuffer
+const output_block = _rw_output_block
+
+// Audio blocks are planar with a fixed channel stride set by the host, channel
+// N starts at N * _rw_block_frames samples regardless of the frame count.
+// This allows creating the channel views once and reusing them for every run.
+
+export let _rw_block_frames: i32
+
+let inputViews: Float32Array[] = []
+let outputViews: Float32Array[] = []
+let audioViewFrames: i32 = -1
+
+function create_audio_views(): void {
+    inputViews = []
+
+    for (let i: i32 = 0; i < _rw_num_inputs; ++i) {
+        inputViews.push(Float32Array.wrap(_rw_input_block, i * _rw_block_frames * 4, _rw_block_frames))
+    }
+
+    outputViews = []
+
+    for (let i: i32 = 0; i < _rw_num_outputs; ++i) {
+        outputViews.push(Float32Array.wrap(_rw_output_block, i * _rw_block_frames * 4, _rw_block_frames))
+    }
+
+    audioViewFrames = _rw_block_frames
+}
+
+function resize_audio_views(frames: u32): void {
+    if (audioViewFrames == -1) {
+        create_audio_views() // run() without a prior activate()
+    }
+
+    for (let i: i32 = 0; i < inputViews.length; ++i) {
+        retarget_view(inputViews[i], i * _rw_block_frames * 4, frames * 4)
+    }
+
+    for (let i: i32 = 0; i < outputViews.length; ++i) {
+        retarget_view(outputViews[i], i * _rw_block_frames * 4, frames * 4)
+    }
+
+    audioViewFrames = <i32>frames
+}
+
+// Points an existing view to another region of the same buffer. Wrapping the
+// region with a new view would allocate a GC managed object.
+
+function retarget_view<T extends ArrayBufferView>(view: T, byteOffset: i32, byteLength: i32): void {
+    const ptr = changetype<usize>(view)
+    store<usize>(ptr, changetype<usize>(view.buffer) + <usize>byteOffset, offsetof<T>('dataStart'))
+    store<i32>(ptr, byteLength, offsetof<T>('byteLength'))
+}
+
+// MIDI input block, allocated by init() with the size set by the host in
+// _rw_midi_block_bytes. The host reads the size back after init() and never
+// writes past it. SysEx messages not fitting the block arrive in chunks over
+// consecutive run() calls, only the first chunk starts with F0.
+
+export let _rw_midi_block_bytes: i32
+export let _rw_midi_block = new ArrayBuffer(0)
+
+let raw_midi_events = new DataView(_rw_midi_block)
+
+// Event objects are reused across run() calls. Every MIDI event takes at least
+// 8 bytes in the MIDI block, which bounds the number of events per block.
+
+let midiEventPool: DISTRHO.MidiEvent[] = []
+let midiEvents: DISTRHO.MidiEvent[] = []
+
+function create_midi_block(): void {
+    _rw_midi_block_bytes = max(_rw_midi_block_bytes, 0)
+    _rw_midi_block = new ArrayBuffer(_rw_midi_block_bytes)
+    raw_midi_events = new DataView(_rw_midi_block)
+
+    const maxEvents = _rw_midi_block_bytes / 8
+    midiEventPool = []
+    midiEvents = []
+
+    for (let i: i32 = 0; i < maxEvents; ++i) {
+        let event = new DISTRHO.MidiEvent
+        event.data = Uint8Array.wrap(_rw_midi_block, 0, 0)
+        midiEventPool.push(event)
+        midiEvents.push(event) // reserve capacity
+    }
+}
+
+// Output MIDI events written during run(), same layout as the input block.
+// _rw_midi_out_bytes is the number of bytes used. MAX_MIDI_OUT_BYTES must match
+// MAX_MIDI_OUTPUT_BYTES in WasmPluginImpl.cpp
+
+const MAX_MIDI_OUT_BYTES = 6144
+
+export let _rw_midi_out_block = new ArrayBuffer(MAX_MIDI_OUT_BYTES)
+export let _rw_midi_out_bytes: i32 = 0
+export let _rw_midi_out_dropped: i32 = 0
+
+let raw_midi_out_events = new DataView(_rw_midi_out_block, 0, MAX_MIDI_OUT_BYTES)
+
+// Parameter events are 12 bytes each: frame (u32), index (u32) and value (f32).
+// MAX_PARAM_EVENTS must match MAX_PARAMETER_EVENTS in WasmPluginImpl.cpp
+
+const MAX_PARAM_EVENTS = 512
+const MAX_PARAM_EVENT_BYTES = 12 * MAX_PARAM_EVENTS
+
+export let _rw_param_block = new ArrayBuffer(MAX_PARAM_EVENT_BYTES)
+
+let raw_param_events = new DataView(_rw_param_block, 0, MAX_PARAM_EVENT_BYTES)
+
+let parameterEventPool: DISTRHO.ParameterEvent[] = []
+let parameterEvents: DISTRHO.ParameterEvent[] = []
+
+for (let i = 0; i < MAX_PARAM_EVENTS; ++i) {
+    let event = new DISTRHO.ParameterEvent
+    parameterEventPool.push(event)
+    parameterEvents.push(event) // reserve capacity
+}
+
+// Transport state, 64 bytes. Integers are LE, bools are u32.
+//   0 playing, 4 bbt.valid, 8 frame (u64), 16 bar (i32), 20 beat (i32),
+//   24 tick (f64), 32 barStartTick (f64), 40 beatsPerBar (f32),
+//   44 beatType (f32), 48 ticksPerBeat (f64), 56 beatsPerMinute (f64)
+// TIME_POSITION_BYTES must match TIME_POSITION_BYTES in WasmPluginImpl.cpp
+
+const TIME_POSITION_BYTES = 64
+
+export let _rw_time_block = new ArrayBuffer(TIME_POSITION_BYTES)
+
+let raw_time_position = new DataView(_rw_time_block, 0, TIME_POSITION_BYTES)
+let timePosition = new DISTRHO.TimePosition
 
 // These are useful for passing strings from host to Wasm
 